@@ -1,10 +1,19 @@
 #pragma once
 
 #include <vector>
+#include <cmath>
 #include <iostream>
 #include <string>
+#include <cstring>
+#include <cstdint>
+#include <utility>
+#include <algorithm>
+#include <atomic>
+#include <thread>
 
 #include "state.h"
+#include "sparse.h"
+#include "mapping.h"
 
 template <unsigned int no_qubits>
 class circuit;
@@ -15,26 +24,64 @@ std::ostream &operator<<(std::ostream &out, circuit <no_qubits> &to_draw);
 /*
  * Circuit class. Manages gate placement, drawing and simplifying to a 'circuit matrix'. This optimization allows the
  * circuit to be calculated a single time and then reused for different states.
+ * The circuit is kept as a list of instructions in the order they were placed, together with the dependency graph
+ * between them: every gate depends on the last earlier gate of each qubit it reads. Gates that do not depend on each
+ * other, directly or not, touch disjoint qubits and can be reordered freely, as long as no bar lies between them.
  * This class is unable to handle measurements. Please call them from the state class instead.
  */
 template <unsigned int no_qubits>
 class circuit {
 private:
-	std::vector <std::vector <char>> gates;
-	std::vector <unsigned int> gate_stops;
-	std::vector <std::vector <double>> data;
-	std::vector <unsigned int> last_gate;
+	std::vector <instruction> gates;
+	std::vector <std::uint32_t> bars; // number of gates placed before each bar
+	std::vector <std::uint32_t> dependency_start; // dependencies of gate i are [dependency_start[i], dependency_start[i + 1])
+	std::vector <std::uint32_t> dependencies;
+	std::vector <std::uint32_t> last_gate; // last gate of each qubit plus one, 0 if none
 
-	unsigned int getSpot(unsigned int pos);
-	unsigned int getSpot(unsigned int pos1, unsigned int pos2);
+	void placeGate(const instruction &gate);
+	void controlSetup(char id, const std::vector <unsigned int> &posC, unsigned int posT, double phase);
+	void Rebuild();
 
-	unsigned int controlSetup(unsigned int posC, unsigned int posT);
-	unsigned int controlSetup(std::vector <unsigned int> posC, unsigned int posT);
+	/*
+	 * Helpers of the optimisation passes. 'lookback' bounds how many earlier gates a gate is moved past to meet one it
+	 * cancels with, and angles within 'tolerance' of a multiple of 2 * pi are taken as exact.
+	 */
+	static constexpr unsigned int lookback = 64;
+	static constexpr double tolerance = 1e-12;
+	static bool isIdentity(const instruction &gate);
+	static bool commute(const instruction &first, const instruction &second);
+	static bool merge(instruction &into, const instruction &next);
 
 	bool up_to_date = false;
 	transform *total = nullptr;
+	schedule plan;
 	void Calculate();
+
+	/*
+	 * Layout of a compiled program file. The header is followed, each at an 8 byte aligned offset, by the instructions,
+	 * the bars, the dependency graph and, if 'compiled' is set, the circuit matrix. All values are stored in native byte
+	 * order and the instructions with their native layout, so they can be copied back as they are.
+	 */
+	struct file_header {
+		char magic[4];
+		std::uint32_t version;
+		std::uint32_t qubits;
+		std::uint32_t compiled;
+		std::uint64_t no_gates;
+		std::uint64_t no_bars;
+		std::uint64_t no_dependencies;
+		std::uint32_t instruction_size;
+		std::uint32_t reserved;
+		double norm_factor;
+	};
+	static constexpr std::uint32_t file_version = 2;
+	static std::size_t alignFile(std::size_t offset);
 public:
+	/*
+	 * Largest register that still gets a circuit matrix. Larger circuits are applied gate by gate instead.
+	 */
+	static constexpr unsigned int matrix_qubits = 6;
+
 	circuit();
 
 	/*
@@ -65,11 +112,56 @@ public:
 	void CCRY(const std::vector <unsigned int> &posC, unsigned int posY, double phase);
 	void CCRZ(const std::vector <unsigned int> &posC, unsigned int posZ, double phase);
 
+	/*
+	 * Simplifies the circuit without changing what it does, and returns the number of gates removed. Rotations by a
+	 * multiple of 2 * pi are dropped, and every gate is moved back past the gates it commutes with to meet an earlier
+	 * gate of the same kind: H gates and self inverse pairs such as CX CX cancel, and rotations about the same axis
+	 * merge into one. Gates are never moved across a bar.
+	 */
+	std::size_t Optimize();
+
+	/*
+	 * Computes the matrix of the circuit by running every basis state through the gate kernels, in parallel across the
+	 * columns. The 2 ^ no_qubits by 2 ^ no_qubits matrix is written to 'out' in row-major order.
+	 */
+	void Unitary(std::complex <double> *out) const;
+	std::vector <std::complex <double>> Unitary() const;
+
 	/*
 	 * Runs a given state through the circuit. If necessary recalculates the circuit.
 	 */
 	void Apply(state <no_qubits>&init);
 
+	/*
+	 * Runs a sparse state through the circuit gate by gate. Never builds the circuit matrix.
+	 */
+	void Apply(sparse_state <no_qubits> &init) const;
+
+	/*
+	 * Runs 'batch' normalised state vectors through the circuit at once, each gate being applied to all of them in a
+	 * single pass. The vectors are stored interleaved, amplitude 'mask' of vector 'ind' at index mask * batch + ind, both
+	 * in 'in' and in the caller provided 'out', which may be the same buffer as 'in'.
+	 */
+	void Apply(const std::complex <double> *in, std::complex <double> *out, std::size_t batch) const;
+
+	/*
+	 * Returns the instructions of the circuit, in the order they are applied
+	 */
+	const std::vector <instruction> &Instructions() const;
+
+	/*
+	 * Returns the gates a given gate directly depends on, as a range of indices into 'Instructions'
+	 */
+	std::pair <const std::uint32_t *, const std::uint32_t *> Dependencies(std::size_t gate) const;
+
+	/*
+	 * Saves the circuit together with its circuit matrix, if it has one, to a compiled program file. Loading maps the
+	 * file, checks every instruction and bar and rebuilds the dependency graph from them, while the circuit matrix is
+	 * copied back as is, so a loaded circuit does not have to be recalculated before use.
+	 */
+	void Save(const std::string &path);
+	void Load(const std::string &path);
+
 	/*
 	 * Draws a schematic of the current circuit to the given output buffer. Uses only extended ascii characters.
 	 */
@@ -78,265 +170,306 @@ public:
 };
 
 template <unsigned int no_qubits>
-circuit <no_qubits>::circuit () : gates(), data(), last_gate(no_qubits, 0)  {}
+circuit <no_qubits>::circuit () : gates(), dependency_start(1, 0), last_gate(no_qubits, 0) {}
 
 template <unsigned int no_qubits>
-unsigned int circuit <no_qubits>::getSpot (unsigned int pos) {
-	if (pos >= no_qubits) {
+void circuit <no_qubits>::placeGate (const instruction &gate) {
+	if (gate.target >= no_qubits || gate.ctl_mask >> no_qubits != 0) {
 		throw std::runtime_error("Qubit index not in range!\n");
 	}
+	if (gate.ctl_mask >> gate.target & 1) {
+		throw std::runtime_error("A qubit cannot be both a control and a target one!\n");
+	}
 	up_to_date = false;
-	while (gates.size() <= last_gate[pos]) {
-		gates.emplace_back(no_qubits, '-');
-		data.emplace_back(no_qubits, 0.0f);
-		gate_stops.emplace_back();
+	std::uint32_t index = gates.size();
+	gates.push_back(gate);
+	std::uint64_t mask = gate.mask();
+	for (unsigned int pos = 0; pos < no_qubits; pos++) {
+		if (mask >> pos & 1) {
+			std::uint32_t last = last_gate[pos];
+			bool seen = false;
+			for (std::uint32_t ind = dependency_start.back(); ind < dependencies.size(); ind++) {
+				seen |= dependencies[ind] == last - 1;
+			}
+			if (last != 0 && !seen) {
+				dependencies.push_back(last - 1);
+			}
+			last_gate[pos] = index + 1;
+		}
 	}
-	last_gate[pos]++;
-	return last_gate[pos] - 1;
+	dependency_start.push_back(dependencies.size());
 }
 template <unsigned int no_qubits>
-unsigned int circuit <no_qubits>::getSpot (unsigned int pos1, unsigned int pos2) {
-	if (pos1 > pos2 || pos2 >= no_qubits) {
-		throw std::runtime_error("Qubit index not in range!\n");
-	}
-	up_to_date = false;
-	unsigned int maxi = 0;
-	for (int pos = pos1; pos <= pos2; pos++) {
-		maxi = std::max(maxi, last_gate[pos]);
-	}
-	while (gates.size() <= maxi) {
-		gates.emplace_back(no_qubits, '-');
-		data.emplace_back(no_qubits, 0.0f);
-		gate_stops.emplace_back();
+void circuit <no_qubits>::controlSetup (char id, const std::vector <unsigned int> &posC, unsigned int posT, double phase) {
+	instruction gate = {id, posT, 0, phase};
+	for (unsigned int pos : posC) {
+		if (pos >= no_qubits) {
+			throw std::runtime_error("Qubit index not in range!\n");
+		}
+		gate.ctl_mask |= (std::uint64_t)1 << pos;
 	}
-	for (int pos = pos1; pos <= pos2; pos++) {
-		last_gate[pos] = maxi + 1;
+	placeGate(gate);
+}
+
+template <unsigned int no_qubits>
+void circuit <no_qubits>::Rebuild () {
+	std::vector <instruction> old;
+	std::swap(old, gates);
+	dependency_start.assign(1, 0);
+	dependencies.clear();
+	last_gate.assign(no_qubits, 0);
+	for (const instruction &gate : old) {
+		placeGate(gate);
 	}
-	return maxi;
 }
 
 template <unsigned int no_qubits>
-unsigned int circuit <no_qubits>::controlSetup(unsigned int posC, unsigned int posT) {
-	int start = std::min(posC, posT), stop = std::max(posC, posT);
-	int depth = getSpot(start, stop);
-	for (int pos = start; pos <= stop; pos++) {
-		gates[depth][pos] = '0';
+bool circuit <no_qubits>::isIdentity (const instruction &gate) {
+	// With the global phase RX and RY carry, every rotation by 2 * pi is exactly the identity
+	return gate.id != 'H' && std::abs(std::remainder(gate.phase, 2 * M_PI)) < tolerance;
+}
+template <unsigned int no_qubits>
+bool circuit <no_qubits>::commute (const instruction &first, const instruction &second) {
+	// Both gates are block diagonal over the qubits they only read (controls, or any qubit of a diagonal gate); if those
+	// are all they share, the blocks act on disjoint qubits. Rotations about the same axis also commute on a shared target.
+	std::uint64_t reads1 = first.diagonal() ? first.mask() : first.ctl_mask;
+	std::uint64_t reads2 = second.diagonal() ? second.mask() : second.ctl_mask;
+	std::uint64_t shared = first.mask() & second.mask();
+	if (!first.diagonal() && first.id == second.id && first.id != 'H' && first.target == second.target) {
+		shared &= ~((std::uint64_t)1 << first.target);
 	}
-	gates[depth][posC] = 'c';
-	gate_stops[depth] |= 1 << stop;
-	return depth;
+	return (shared & ~(reads1 & reads2)) == 0;
 }
 template <unsigned int no_qubits>
-unsigned int circuit <no_qubits>::controlSetup(std::vector <unsigned int> posC, unsigned int posT) {
-	int start = posT, stop = posT;
-	for(int pos : posC) {
-		start = std::min(start, pos);
-		stop = std::max(stop, pos);
+bool circuit <no_qubits>::merge (instruction &into, const instruction &next) {
+	if (into.id != next.id || into.mask() != next.mask()) {
+		return false;
+	}
+	if (into.diagonal()) {
+		// A diagonal gate is the same whichever of its qubits is the target
+		into.phase += next.phase;
+	}
+	else if (into.target != next.target) {
+		return false;
+	}
+	else if (into.id == 'H') {
+		into.phase = 0;
 	}
-	int depth = getSpot(start, stop);
-	for (int pos = start; pos <= stop; pos++) {
-		gates[depth][pos] = '0';
+	else {
+		into.phase += next.phase;
+	}
+	// Keep exact half turns exact, so X gates stay on the permutation path
+	if (std::abs(std::abs(std::remainder(into.phase, 2 * M_PI)) - M_PI) < tolerance) {
+		into.phase = M_PI;
+	}
+	return true;
+}
+
+template <unsigned int no_qubits>
+std::size_t circuit <no_qubits>::Optimize () {
+	std::vector <instruction> kept;
+	std::vector <bool> alive;
+	std::size_t no_alive = 0, barrier = 0, next_bar = 0;
+	for (std::size_t ind = 0; ind <= gates.size(); ind++) {
+		for (; next_bar < bars.size() && bars[next_bar] == ind; next_bar++) {
+			bars[next_bar] = no_alive;
+			barrier = kept.size();
+		}
+		if (ind == gates.size()) {
+			break;
+		}
+		const instruction &gate = gates[ind];
+		if (isIdentity(gate)) {
+			continue;
+		}
+		bool placed = false;
+		unsigned int passed = 0;
+		for (std::size_t back = kept.size(); back > barrier && passed < lookback; back--) {
+			if (!alive[back - 1]) {
+				continue;
+			}
+			instruction &earlier = kept[back - 1];
+			if (merge(earlier, gate)) {
+				if (earlier.id == 'H' || isIdentity(earlier)) {
+					alive[back - 1] = false;
+					no_alive--;
+				}
+				placed = true;
+				break;
+			}
+			if (!commute(earlier, gate)) {
+				break;
+			}
+			passed++;
+		}
+		if (!placed) {
+			kept.push_back(gate);
+			alive.push_back(true);
+			no_alive++;
+		}
 	}
-	for(int pos : posC) {
-		gates[depth][pos] = 'c';
+
+	std::size_t removed = gates.size() - no_alive;
+	gates.clear();
+	for (std::size_t ind = 0; ind < kept.size(); ind++) {
+		if (alive[ind]) {
+			gates.push_back(kept[ind]);
+		}
 	}
-	gate_stops[depth] |= 1 << stop;
-	return depth;
+	Rebuild();
+	up_to_date = false;
+	return removed;
 }
 
 template <unsigned int no_qubits>
 void circuit <no_qubits>::Bar () {
-	getSpot(0, no_qubits - 1);
-	gates.back()[0] = '|';
+	bars.push_back(gates.size());
 }
 
 template <unsigned int no_qubits>
 void circuit <no_qubits>::H (unsigned int pos) {
-	int depth = getSpot(pos);
-	gates[depth][pos] = 'H';
-	data[depth][pos] = M_PI;
+	placeGate({'H', pos, 0, M_PI});
 }
 
 template <unsigned int no_qubits>
 void circuit <no_qubits>::X (unsigned int pos) {
-	int depth = getSpot(pos);
-	gates[depth][pos] = 'X';
-	data[depth][pos] = M_PI;
+	placeGate({'X', pos, 0, M_PI});
 }
 template <unsigned int no_qubits>
 void circuit <no_qubits>::Y (unsigned int pos) {
-	int depth = getSpot(pos);
-	gates[depth][pos] = 'Y';
-	data[depth][pos] = M_PI;
+	placeGate({'Y', pos, 0, M_PI});
 }
 template <unsigned int no_qubits>
 void circuit <no_qubits>::Z (unsigned int pos) {
-	int depth = getSpot(pos);
-	gates[depth][pos] = 'Z';
-	data[depth][pos] = M_PI;
+	placeGate({'Z', pos, 0, M_PI});
 }
 template <unsigned int no_qubits>
 void circuit <no_qubits>::RX (unsigned int pos, double phase) {
-	int depth = getSpot(pos);
-	gates[depth][pos] = 'X';
-	data[depth][pos] = phase;
+	placeGate({'X', pos, 0, phase});
 }
 template <unsigned int no_qubits>
 void circuit <no_qubits>::RY (unsigned int pos, double phase) {
-	int depth = getSpot(pos);
-	gates[depth][pos] = 'Y';
-	data[depth][pos] = phase;
+	placeGate({'Y', pos, 0, phase});
 }
 template <unsigned int no_qubits>
 void circuit <no_qubits>::RZ (unsigned int pos, double phase) {
-	int depth = getSpot(pos);
-	gates[depth][pos] = 'Z';
-	data[depth][pos] = phase;
+	placeGate({'Z', pos, 0, phase});
 }
 
 template <unsigned int no_qubits>
 void circuit <no_qubits>::CX (unsigned int posC, unsigned int posX) {
-	int depth = controlSetup(posC, posX);
-	gates[depth][posX] = 'x';
-	data[depth][posX] = M_PI;
+	controlSetup('X', {posC}, posX, M_PI);
 }
 template <unsigned int no_qubits>
 void circuit <no_qubits>::CY (unsigned int posC, unsigned int posY) {
-	int depth = controlSetup(posC, posY);
-	gates[depth][posY] = 'y';
-	data[depth][posY] = M_PI;
+	controlSetup('Y', {posC}, posY, M_PI);
 }
 template <unsigned int no_qubits>
 void circuit <no_qubits>::CZ (unsigned int posC, unsigned int posZ) {
-	int depth = controlSetup(posC, posZ);
-	gates[depth][posZ] = 'z';
-	data[depth][posZ] = M_PI;
+	controlSetup('Z', {posC}, posZ, M_PI);
 }
 template <unsigned int no_qubits>
 void circuit <no_qubits>::CCX (const std::vector <unsigned int> &posC, unsigned int posX) {
-	int depth = controlSetup(posC, posX);
-	gates[depth][posX] = 'x';
-	data[depth][posX] = M_PI;
+	controlSetup('X', posC, posX, M_PI);
 }
 template <unsigned int no_qubits>
 void circuit <no_qubits>::CCY (const std::vector <unsigned int> &posC, unsigned int posY) {
-	int depth = controlSetup(posC, posY);
-	gates[depth][posY] = 'y';
-	data[depth][posY] = M_PI;
+	controlSetup('Y', posC, posY, M_PI);
 }
 template <unsigned int no_qubits>
 void circuit <no_qubits>::CCZ (const std::vector <unsigned int> &posC, unsigned int posZ) {
-	int depth = controlSetup(posC, posZ);
-	gates[depth][posZ] = 'z';
-	data[depth][posZ] = M_PI;
+	controlSetup('Z', posC, posZ, M_PI);
 }
 template <unsigned int no_qubits>
 void circuit <no_qubits>::CRX (unsigned int posC, unsigned int posX, double phase) {
-	int depth = controlSetup(posC, posX);
-	gates[depth][posX] = 'x';
-	data[depth][posX] = phase;
+	controlSetup('X', {posC}, posX, phase);
 }
 template <unsigned int no_qubits>
 void circuit <no_qubits>::CRY (unsigned int posC, unsigned int posY, double phase) {
-	int depth = controlSetup(posC, posY);
-	gates[depth][posY] = 'y';
-	data[depth][posY] = phase;
+	controlSetup('Y', {posC}, posY, phase);
 }
 template <unsigned int no_qubits>
 void circuit <no_qubits>::CRZ (unsigned int posC, unsigned int posZ, double phase) {
-	int depth = controlSetup(posC, posZ);
-	gates[depth][posZ] = 'z';
-	data[depth][posZ] = phase;
+	controlSetup('Z', {posC}, posZ, phase);
 }
 template <unsigned int no_qubits>
 void circuit <no_qubits>::CCRX (const std::vector <unsigned int> &posC, unsigned int posX, double phase) {
-	int depth = controlSetup(posC, posX);
-	gates[depth][posX] = 'x';
-	data[depth][posX] = phase;
+	controlSetup('X', posC, posX, phase);
 }
 template <unsigned int no_qubits>
 void circuit <no_qubits>::CCRY (const std::vector <unsigned int> &posC, unsigned int posY, double phase) {
-	int depth = controlSetup(posC, posY);
-	gates[depth][posY] = 'y';
-	data[depth][posY] = phase;
+	controlSetup('Y', posC, posY, phase);
 }
 template <unsigned int no_qubits>
 void circuit <no_qubits>::CCRZ (const std::vector <unsigned int> &posC, unsigned int posZ, double phase) {
-	int depth = controlSetup(posC, posZ);
-	gates[depth][posZ] = 'z';
-	data[depth][posZ] = phase;
+	controlSetup('Z', posC, posZ, phase);
 }
 
 template <unsigned int no_qubits>
 void circuit <no_qubits>::Calculate () {
 	delete total;
-	total = new transform(gateI, no_qubits);
-	transform *temp, *dyn;
-	for (int depth = 0; depth < gates.size(); depth++) {
-		std::vector <char> &layer = gates[depth];
-		if (layer[0] == '|') {
-			continue;
-		}
-		temp = new transform(gateI, 0u);
-		for (int ind = 0; ind < layer.size(); ind++) {
-			if (layer[ind] == '-') {
-				dyn = new transform(gateI);
-			}
-			else if (layer[ind] == 'H') {
-				dyn = new transform(gateH);
-			}
-			else if (layer[ind] == 'X') {
-				dyn = new transform(gateRX, data[depth][ind]);
-			}
-			else if (layer[ind] == 'Y') {
-				dyn = new transform(gateRY, data[depth][ind]);
-			}
-			else if (layer[ind] == 'Z') {
-				dyn = new transform(gateRZ, data[depth][ind]);
+	total = nullptr;
+	if (no_qubits > matrix_qubits) {
+		plan = schedule(gates.data(), gates.data() + gates.size(), no_qubits);
+		up_to_date = true;
+		return;
+	}
+	std::size_t dim = (std::size_t)1 << no_qubits;
+	std::vector <std::complex <double>> unitary = Unitary();
+	total = new transform(gate0, no_qubits);
+	for (std::size_t row = 0; row < dim; row++) {
+		std::copy(unitary.begin() + row * dim, unitary.begin() + (row + 1) * dim, total->matrix[row].begin());
+	}
+#ifdef DEBUG
+	total->Show();
+#endif
+	up_to_date = true;
+}
+
+template <unsigned int no_qubits>
+void circuit <no_qubits>::Unitary(std::complex <double> *out) const {
+	std::size_t dim = (std::size_t)1 << no_qubits;
+	schedule columns_plan(gates.data(), gates.data() + gates.size(), no_qubits);
+
+	// Columns are simulated a few at a time, so that every row of the output is written a whole tile at once
+	constexpr std::size_t tile = 8;
+	std::size_t no_tiles = (dim + tile - 1) / tile;
+	std::atomic <std::size_t> next_tile(0);
+	auto work = [&]() {
+		std::vector <std::complex <double>> columns(tile * dim);
+		for (std::size_t now = next_tile++; now < no_tiles; now = next_tile++) {
+			std::size_t first = now * tile, count = std::min(tile, dim - first);
+			for (std::size_t col = 0; col < count; col++) {
+				std::complex <double> *column = columns.data() + col * dim;
+				std::fill(column, column + dim, 0);
+				column[first + col] = 1;
+				columns_plan.run(column, dim);
 			}
-			else {
-				unsigned int len = 0;
-				unsigned int type, target;
-				std::vector <unsigned int> ctls;
-				while (ind < layer.size()) {
-					if (layer[ind] == 'c') {
-						ctls.push_back(len);
-					}
-					else if (layer[ind] != '0') {
-						type = ind;
-						target = len;
-					}
-					len++;
-					if (gate_stops[depth] & (1 << ind)) {
-						break;
-					}
-					ind++;
-				}
-				switch (layer[type]) {
-				case 'x':
-					dyn = new transform(gateCRX, len, target, ctls, data[depth][type]);
-					break;
-				case 'y':
-					dyn = new transform(gateCRY, len, target, ctls, data[depth][type]);
-					break;
-				case 'z':
-					dyn = new transform(gateCRZ, len, target, ctls, data[depth][type]);
-					break;
-				default:
-					throw std::runtime_error("Invalid gate found!\n");
+			for (std::size_t row = 0; row < dim; row++) {
+				for (std::size_t col = 0; col < count; col++) {
+					out[row * dim + first + col] = columns[col * dim + row];
 				}
 			}
-			*temp |= *dyn;
-			delete dyn;
 		}
-		*total *= *temp;
-#ifdef DEBUG
-		temp->Show();
-		total->Show();
-#endif
-		delete temp;
+	};
+
+	// Small matrices are not worth the threads
+	unsigned int no_threads = no_qubits < 8 ? 1 : std::max(1u, std::thread::hardware_concurrency());
+	no_threads = (unsigned int)std::min <std::size_t>(no_threads, no_tiles);
+	std::vector <std::thread> threads;
+	for (unsigned int ind = 1; ind < no_threads; ind++) {
+		threads.emplace_back(work);
 	}
-	up_to_date = true;
+	work();
+	for (std::thread &now : threads) {
+		now.join();
+	}
+}
+template <unsigned int no_qubits>
+std::vector <std::complex <double>> circuit <no_qubits>::Unitary() const {
+	std::vector <std::complex <double>> ans(((std::size_t)1 << no_qubits) << no_qubits);
+	Unitary(ans.data());
+	return ans;
 }
 
 template <unsigned int no_qubits>
@@ -344,7 +477,134 @@ void circuit <no_qubits>::Apply(state <no_qubits> &init) {
 	if (!up_to_date) {
 		Calculate();
 	}
-	init = *total * init;
+	if (total != nullptr) {
+		init = *total * init;
+	}
+	else {
+		init.apply(plan);
+	}
+}
+
+template <unsigned int no_qubits>
+void circuit <no_qubits>::Apply(sparse_state <no_qubits> &init) const {
+	init.apply(gates.data(), gates.data() + gates.size());
+}
+
+template <unsigned int no_qubits>
+void circuit <no_qubits>::Apply(const std::complex <double> *in, std::complex <double> *out, std::size_t batch) const {
+	std::size_t dim = (std::size_t)1 << no_qubits;
+	if (in != out) {
+		std::copy(in, in + dim * batch, out);
+	}
+	for (const instruction &gate : gates) {
+		applyGateBatch(out, dim, batch, gate);
+	}
+}
+
+template <unsigned int no_qubits>
+const std::vector <instruction> &circuit <no_qubits>::Instructions() const {
+	return gates;
+}
+template <unsigned int no_qubits>
+std::pair <const std::uint32_t *, const std::uint32_t *> circuit <no_qubits>::Dependencies(std::size_t gate) const {
+	return {dependencies.data() + dependency_start[gate], dependencies.data() + dependency_start[gate + 1]};
+}
+
+template <unsigned int no_qubits>
+std::size_t circuit <no_qubits>::alignFile(std::size_t offset) {
+	return (offset + 7) & ~(std::size_t)7;
+}
+
+template <unsigned int no_qubits>
+void circuit <no_qubits>::Save(const std::string &path) {
+	if (!up_to_date) {
+		Calculate();
+	}
+	std::size_t dim = (std::size_t)1 << no_qubits;
+	std::size_t gates_at = alignFile(sizeof(file_header));
+	std::size_t bars_at = alignFile(gates_at + gates.size() * sizeof(instruction));
+	std::size_t starts_at = alignFile(bars_at + bars.size() * sizeof(std::uint32_t));
+	std::size_t dependencies_at = alignFile(starts_at + dependency_start.size() * sizeof(std::uint32_t));
+	std::size_t matrix_at = alignFile(dependencies_at + dependencies.size() * sizeof(std::uint32_t));
+	std::size_t file_size = total != nullptr ? matrix_at + dim * dim * sizeof(std::complex <double>) : matrix_at;
+
+	mapping out(path, file_size);
+	char *base = static_cast <char *>(out.data());
+	file_header header = {{'Q', 'C', 'I', 'R'}, file_version, no_qubits, total != nullptr, gates.size(), bars.size(), dependencies.size(),
+	                      sizeof(instruction), 0, total != nullptr ? total->norm_factor : 1};
+	std::memcpy(base, &header, sizeof(header));
+	std::memcpy(base + gates_at, gates.data(), gates.size() * sizeof(instruction));
+	std::memcpy(base + bars_at, bars.data(), bars.size() * sizeof(std::uint32_t));
+	std::memcpy(base + starts_at, dependency_start.data(), dependency_start.size() * sizeof(std::uint32_t));
+	std::memcpy(base + dependencies_at, dependencies.data(), dependencies.size() * sizeof(std::uint32_t));
+	for (std::size_t row = 0; total != nullptr && row < dim; row++) {
+		std::memcpy(base + matrix_at + row * dim * sizeof(std::complex <double>), total->matrix[row].data(), dim * sizeof(std::complex <double>));
+	}
+	out.flush();
+}
+template <unsigned int no_qubits>
+void circuit <no_qubits>::Load(const std::string &path) {
+	mapping in(path);
+	const char *base = static_cast <const char *>(in.data());
+	file_header header;
+	if (in.size() < sizeof(header)) {
+		throw std::runtime_error("File is not a compiled circuit!\n");
+	}
+	std::memcpy(&header, base, sizeof(header));
+	if (std::memcmp(header.magic, "QCIR", 4) != 0 || header.version != file_version || header.instruction_size != sizeof(instruction)) {
+		throw std::runtime_error("File is not a compiled circuit of a supported version!\n");
+	}
+	if (header.qubits != no_qubits) {
+		throw std::runtime_error("Compiled circuit has a different number of qubits!\n");
+	}
+	if (header.no_gates > in.size() || header.no_bars > in.size() || header.no_dependencies > in.size()) {
+		throw std::runtime_error("Compiled circuit file is truncated!\n");
+	}
+	std::size_t dim = (std::size_t)1 << no_qubits;
+	std::size_t gates_at = alignFile(sizeof(file_header));
+	std::size_t bars_at = alignFile(gates_at + header.no_gates * sizeof(instruction));
+	std::size_t starts_at = alignFile(bars_at + header.no_bars * sizeof(std::uint32_t));
+	std::size_t dependencies_at = alignFile(starts_at + (header.no_gates + 1) * sizeof(std::uint32_t));
+	std::size_t matrix_at = alignFile(dependencies_at + header.no_dependencies * sizeof(std::uint32_t));
+	std::size_t file_size = header.compiled ? matrix_at + dim * dim * sizeof(std::complex <double>) : matrix_at;
+	if (in.size() < file_size) {
+		throw std::runtime_error("Compiled circuit file is truncated!\n");
+	}
+
+	// Nothing read from the file is trusted: the gates go through the usual checks into a fresh circuit, whose
+	// dependency graph is rebuilt from them rather than copied
+	circuit <no_qubits> loaded;
+	for (std::size_t ind = 0; ind < header.no_gates; ind++) {
+		instruction gate;
+		std::memcpy(&gate, base + gates_at + ind * sizeof(instruction), sizeof(instruction));
+		if (gate.id != 'H' && gate.id != 'X' && gate.id != 'Y' && gate.id != 'Z') {
+			throw std::runtime_error("Invalid gate found!\n");
+		}
+		loaded.placeGate(gate);
+	}
+	loaded.bars.resize(header.no_bars);
+	std::memcpy(loaded.bars.data(), base + bars_at, loaded.bars.size() * sizeof(std::uint32_t));
+	for (std::size_t ind = 0; ind < loaded.bars.size(); ind++) {
+		if (loaded.bars[ind] > header.no_gates || (ind > 0 && loaded.bars[ind] < loaded.bars[ind - 1])) {
+			throw std::runtime_error("Compiled circuit has invalid bars!\n");
+		}
+	}
+	gates.swap(loaded.gates);
+	bars.swap(loaded.bars);
+	dependency_start.swap(loaded.dependency_start);
+	dependencies.swap(loaded.dependencies);
+	last_gate.swap(loaded.last_gate);
+	delete total;
+	total = nullptr;
+	up_to_date = false;
+	if (header.compiled) {
+		total = new transform(gate0, no_qubits);
+		total->norm_factor = header.norm_factor;
+		for (std::size_t row = 0; row < dim; row++) {
+			std::memcpy(total->matrix[row].data(), base + matrix_at + row * dim * sizeof(std::complex <double>), dim * sizeof(std::complex <double>));
+		}
+		up_to_date = true;
+	}
 }
 
 #define DBar (char)186
@@ -363,7 +623,58 @@ void circuit <no_qubits>::Apply(state <no_qubits> &init) {
 
 template <unsigned int no_qubits>
 void circuit <no_qubits>::Draw(std::ostream &out) {
-	if (!gates.empty()) {
+	// Lay the instructions out on a grid: every gate takes the first column that is free on all the qubits it spans
+	std::vector <std::vector <char>> grid;
+	std::vector <std::vector <double>> grid_data;
+	std::vector <std::uint64_t> grid_stops;
+	std::vector <unsigned int> last_layer(no_qubits, 0);
+	auto getSpot = [&](unsigned int pos1, unsigned int pos2) {
+		unsigned int maxi = 0;
+		for (unsigned int pos = pos1; pos <= pos2; pos++) {
+			maxi = std::max(maxi, last_layer[pos]);
+		}
+		while (grid.size() <= maxi) {
+			grid.emplace_back(no_qubits, '-');
+			grid_data.emplace_back(no_qubits, 0.0);
+			grid_stops.emplace_back();
+		}
+		for (unsigned int pos = pos1; pos <= pos2; pos++) {
+			last_layer[pos] = maxi + 1;
+		}
+		return maxi;
+	};
+	std::size_t next_bar = 0;
+	for (std::size_t ind = 0; ind <= gates.size(); ind++) {
+		for (; next_bar < bars.size() && bars[next_bar] == ind; next_bar++) {
+			getSpot(0, no_qubits - 1);
+			grid.back()[0] = '|';
+		}
+		if (ind == gates.size()) {
+			break;
+		}
+		const instruction &gate = gates[ind];
+		unsigned int start = gate.target, stop = gate.target;
+		for (unsigned int pos = 0; pos < no_qubits; pos++) {
+			if (gate.ctl_mask >> pos & 1) {
+				start = std::min(start, pos);
+				stop = std::max(stop, pos);
+			}
+		}
+		unsigned int depth = getSpot(start, stop);
+		if (gate.ctl_mask == 0) {
+			grid[depth][gate.target] = gate.id;
+		}
+		else {
+			for (unsigned int pos = start; pos <= stop; pos++) {
+				grid[depth][pos] = gate.ctl_mask >> pos & 1 ? 'c' : '0';
+			}
+			grid[depth][gate.target] = gate.id + 32;
+			grid_stops[depth] |= (std::uint64_t)1 << stop;
+		}
+		grid_data[depth][gate.target] = gate.phase;
+	}
+
+	if (!grid.empty()) {
 		static std::string HBar7(7, HBar);
 		static std::string upEdge = {LUcorn, HBar, HBar, HBar, HBar, HBar, RUcorn};
 		static std::string downEdge = {LDcorn, HBar, HBar, HBar, HBar, HBar, RDcorn};
@@ -376,8 +687,8 @@ void circuit <no_qubits>::Draw(std::ostream &out) {
 			result[3 * ind + 1] += HBar;
 			result[3 * ind + 2] += ' ';
 		}
-		for(int depth = 0; depth < gates.size(); depth++) {
-			if (gates[depth][0] == '|') {
+		for(int depth = 0; depth < grid.size(); depth++) {
+			if (grid[depth][0] == '|') {
 				for(int ind = 0; ind < no_qubits; ind++) {
 					result[3 * ind] += { DBar, ' ', };
 					result[3 * ind + 1] += { DBar, HBar, };
@@ -387,27 +698,27 @@ void circuit <no_qubits>::Draw(std::ostream &out) {
 			else {
 				int ctrl_last = false, ctrl_now, ctrl_stop;
 				for(int ind = 0; ind < no_qubits; ind++) {
-					ctrl_stop = gate_stops[depth] & (1 << ind);
-					if (gates[depth][ind] == '-') {
+					ctrl_stop = grid_stops[depth] >> ind & 1;
+					if (grid[depth][ind] == '-') {
 						result[3 * ind] +=     "       ";
 						result[3 * ind + 1] += HBar7;
 						result[3 * ind + 2] += "       ";
 						ctrl_last = false;
 					}
-					else if (gates[depth][ind] == 'X' || gates[depth][ind] == 'Y' || gates[depth][ind] == 'Z' || gates[depth][ind] == 'H') {
+					else if (grid[depth][ind] == 'X' || grid[depth][ind] == 'Y' || grid[depth][ind] == 'Z' || grid[depth][ind] == 'H') {
 						result[3 * ind] += upEdge;
 						result[3 * ind + 1] += sideEdges;
 						result[3 * ind + 2] += downEdge;
-						if(data[depth][ind] == M_PI) {
-							result[3 * ind + 1][result[3 * ind + 1].size() - 4] = gates[depth][ind];
+						if(grid_data[depth][ind] == M_PI) {
+							result[3 * ind + 1][result[3 * ind + 1].size() - 4] = grid[depth][ind];
 						}
 						else {
 							result[3 * ind + 1][result[3 * ind + 1].size() - 4] = 'R';
-							result[3 * ind + 1][result[3 * ind + 1].size() - 3] = gates[depth][ind];
+							result[3 * ind + 1][result[3 * ind + 1].size() - 3] = grid[depth][ind];
 						}
 						ctrl_last = false;
 					}
-					else if (gates[depth][ind] == '0' || gates[depth][ind] == 'c') {
+					else if (grid[depth][ind] == '0' || grid[depth][ind] == 'c') {
 						result[3 * ind] +=     "       ";
 						result[3 * ind + 1] += HBar7;
 						result[3 * ind + 2] += "       ";
@@ -419,22 +730,22 @@ void circuit <no_qubits>::Draw(std::ostream &out) {
 							result[3 * ind + 2][result[3 * ind + 2].size() - 4] = VBar;
 							result[3 * ind + 1][result[3 * ind + 1].size() - 4] = ctrl_last ? cross : upT;
 						}
-						if (gates[depth][ind] == 'c') {
+						if (grid[depth][ind] == 'c') {
 							result[3 * ind + 1][result[3 * ind + 1].size() - 4] = fill;
 						}
 						ctrl_last = !ctrl_stop;
 					}
-					else if (gates[depth][ind] == 'x' || gates[depth][ind] == 'y' || gates[depth][ind] == 'z') {
+					else if (grid[depth][ind] == 'x' || grid[depth][ind] == 'y' || grid[depth][ind] == 'z') {
 						result[3 * ind] +=     ctrl_last ? upEdgeNotch : upEdge;
 						result[3 * ind + 1] += sideEdges;
 						result[3 * ind + 2] += ctrl_stop ? downEdge : downEdgeNotch;
 						result[3 * ind + 1][result[3 * ind + 1].size() - 5] = 'C';
-						if(data[depth][ind] == M_PI) {
-							result[3 * ind + 1][result[3 * ind + 1].size() - 4] = gates[depth][ind] - 32;
+						if(grid_data[depth][ind] == M_PI) {
+							result[3 * ind + 1][result[3 * ind + 1].size() - 4] = grid[depth][ind] - 32;
 						}
 						else {
 							result[3 * ind + 1][result[3 * ind + 1].size() - 4] = 'R';
-							result[3 * ind + 1][result[3 * ind + 1].size() - 3] = gates[depth][ind] - 32;
+							result[3 * ind + 1][result[3 * ind + 1].size() - 3] = grid[depth][ind] - 32;
 						}
 						ctrl_last = !ctrl_stop;
 					}
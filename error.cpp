@@ -4,9 +4,11 @@
 #include <random>
 
 #include "circuit.h"
+#include "small.h"
 
 /*
- * This is an example that uses the circuit and state classes to emulate a basic error correction algorithm.
+ * This is an example that builds its circuits with the circuit class and runs every shot on the small register engine
+ * (small_circuit and small_state) to emulate a basic error correction algorithm.
  * Q0 is the corrected qubit, with Q1 and Q2 as helpers.
  */
 
@@ -31,20 +33,23 @@ int main () {
 	X1.X(1);
 	X2.X(2);
 
+	// Every shot runs on the stack, through circuits compiled for small registers
+	small_circuit <3> fast_encode(encode), fast_decode(decode), fast_X0(X0), fast_X1(X1), fast_X2(X2);
+
 	std::vector <int> cnt(2);
 	for(int ind = 0; ind < 100000; ind++) {
-		state <3> now;
-		encode.Apply(now);
+		small_state <3> now;
+		fast_encode.Apply(now);
 		if (rand() % 10 == 0) {
-			X0.Apply(now);
+			fast_X0.Apply(now);
 		}
 		if (rand() % 10 == 0) {
-			X1.Apply(now);
+			fast_X1.Apply(now);
 		}
 		if (rand() % 10 == 0) {
-			X2.Apply(now);
+			fast_X2.Apply(now);
 		}
-		decode.Apply(now);
+		fast_decode.Apply(now);
 		cnt[now.measure(0)]++;
 	}
 	for (int val : cnt) {
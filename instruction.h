@@ -0,0 +1,71 @@
+#pragma once
+
+#include <array>
+#include <complex>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+
+/*
+ * Single gate of a compiled circuit. The 2x2 matrix selected by 'id' ('H', 'X', 'Y' or 'Z') and 'phase' is applied to
+ * the 'target' qubit of every basis state that has all the qubits in 'ctl_mask' set. The matrices follow the same
+ * conventions as the transform class, including the global phase shift of the rotations, but are already normalised.
+ */
+struct instruction {
+	char id;
+	unsigned int target;
+	std::uint64_t ctl_mask;
+	double phase;
+
+	/*
+	 * Every qubit the instruction reads, that is the controls and the target
+	 */
+	std::uint64_t mask() const;
+
+	/*
+	 * Whether the matrix is diagonal, in which case the gate only multiplies the basis states that have every qubit of
+	 * 'mask' set by e^(i*phase)
+	 */
+	bool diagonal() const;
+
+	/*
+	 * Whether the gate is an X, CX or CCX, that is a pure permutation of the basis states flipping the target qubit of
+	 * every basis state that has all the control qubits set
+	 */
+	bool permutation() const;
+
+	/*
+	 * Returns the matrix in row-major order
+	 */
+	std::array <std::complex <double>, 4> matrix() const;
+};
+
+std::uint64_t instruction::mask() const {
+	return ctl_mask | (std::uint64_t)1 << target;
+}
+
+bool instruction::diagonal() const {
+	return id == 'Z';
+}
+
+bool instruction::permutation() const {
+	return id == 'X' && phase == M_PI;
+}
+
+std::array <std::complex <double>, 4> instruction::matrix() const {
+	using namespace std::complex_literals;
+	double half = phase / 2, cos = std::cos(half), sin = std::sin(half);
+	std::complex <double> phase_shift = cos + 1i * sin;
+	switch (id) {
+	case 'H':
+		return {M_SQRT1_2, M_SQRT1_2, M_SQRT1_2, -M_SQRT1_2};
+	case 'X':
+		return {phase_shift * cos, phase_shift * -1i * sin, phase_shift * -1i * sin, phase_shift * cos};
+	case 'Y':
+		return {phase_shift * cos, phase_shift * -sin, phase_shift * sin, phase_shift * cos};
+	case 'Z':
+		return {1, 0, 0, phase_shift * phase_shift};
+	default:
+		throw std::runtime_error("Gate not recognised!\n");
+	}
+}
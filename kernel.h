@@ -0,0 +1,351 @@
+#pragma once
+
+#include <algorithm>
+#include <complex>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "instruction.h"
+
+/*
+ * Gate kernels. They work in place on a block of 'count' amplitudes (a power of 2) that starts at index 'base' of the
+ * full state vector. Targets have to lie inside the block, while controls may also lie above it, in which case they are
+ * read from 'base'. Diagonal gates are the exception: they only ever look at index bits, so all their qubits may lie
+ * above the block.
+ */
+
+/*
+ * Largest number of distinct qubits inside the block a single phase pass handles; longer runs are split
+ */
+#define PHASE_QUBITS 10
+
+/*
+ * Shortest stretch of X and CX gates worth compiling into a single permutation pass
+ */
+#define PERMUTATION_GATES 8
+
+/*
+ * Applies a run of diagonal instructions in a single pass. The phase of each amplitude only depends on the bits of its
+ * index under the union of the run's masks, so the phases of every combination of those bits are tabulated first and
+ * then looked up, a byte of the index at a time.
+ */
+void applyPhases(std::complex <double> *amps, std::size_t count, std::size_t base, const instruction *first, const instruction *last) {
+	while (first != last) {
+		// Gates whose qubits above the block are not all set do nothing here; the others reduce to their low mask
+		std::vector <std::pair <std::size_t, double>> active;
+		std::size_t used = 0;
+		unsigned int no_used = 0;
+		for (; first != last; first++) {
+			std::size_t mask = first->mask(), high = mask & ~(count - 1), low = mask & (count - 1);
+			if ((base & high) != high) {
+				continue;
+			}
+			unsigned int extra = 0;
+			for (std::size_t rest = low & ~used; rest != 0; rest &= rest - 1) {
+				extra++;
+			}
+			if (no_used + extra > PHASE_QUBITS) {
+				break;
+			}
+			used |= low;
+			no_used += extra;
+			active.emplace_back(low, first->phase);
+		}
+		if (active.empty() && first != last) {
+			// A single gate on too many qubits for a table
+			std::size_t low = first->mask() & (count - 1);
+			std::complex <double> phase = std::polar(1.0, first->phase);
+			for (std::size_t mask = 0; mask < count; mask++) {
+				if ((mask & low) == low) {
+					amps[mask] *= phase;
+				}
+			}
+			first++;
+			continue;
+		}
+
+		std::vector <unsigned int> positions;
+		for (unsigned int pos = 0; (std::size_t)1 << pos < count; pos++) {
+			if (used >> pos & 1) {
+				positions.push_back(pos);
+			}
+		}
+		std::vector <std::complex <double>> table((std::size_t)1 << no_used);
+		for (std::size_t packed = 0; packed < table.size(); packed++) {
+			std::size_t spread = 0;
+			for (unsigned int ind = 0; ind < no_used; ind++) {
+				if (packed >> ind & 1) {
+					spread |= (std::size_t)1 << positions[ind];
+				}
+			}
+			double angle = 0;
+			for (const std::pair <std::size_t, double> &gate : active) {
+				if ((spread & gate.first) == gate.first) {
+					angle += gate.second;
+				}
+			}
+			table[packed] = std::polar(1.0, angle);
+		}
+		if (no_used == 0) {
+			if (table[0] != std::complex <double>(1)) {
+				for (std::size_t mask = 0; mask < count; mask++) {
+					amps[mask] *= table[0];
+				}
+			}
+			continue;
+		}
+
+		// packs[byte][value] holds the packed bits contributed by that byte of the index
+		unsigned int no_bytes = (positions.back() >> 3) + 1;
+		std::vector <std::array <std::uint16_t, 256>> packs(no_bytes);
+		for (unsigned int byte = 0; byte < no_bytes; byte++) {
+			for (unsigned int value = 0; value < 256; value++) {
+				std::uint16_t packed = 0;
+				for (unsigned int ind = 0; ind < no_used; ind++) {
+					if (positions[ind] >> 3 == byte && (value >> (positions[ind] & 7) & 1)) {
+						packed |= 1 << ind;
+					}
+				}
+				packs[byte][value] = packed;
+			}
+		}
+		for (std::size_t mask = 0; mask < count; mask++) {
+			std::size_t packed = 0;
+			for (unsigned int byte = 0; byte < no_bytes; byte++) {
+				packed |= packs[byte][mask >> (8 * byte) & 255];
+			}
+			amps[mask] *= table[packed];
+		}
+	}
+}
+
+
+/*
+ * Returns the basis state a run of permutation gates sends 'index' to
+ */
+std::size_t permuteIndex(std::size_t index, const instruction *first, const instruction *last) {
+	for (; first != last; first++) {
+		if ((index & first->ctl_mask) == first->ctl_mask) {
+			index ^= (std::size_t)1 << first->target;
+		}
+	}
+	return index;
+}
+
+/*
+ * Applies a single instruction to the block
+ */
+void applyGate(std::complex <double> *amps, std::size_t count, std::size_t base, const instruction &gate) {
+	if (gate.diagonal()) {
+		applyPhases(amps, count, base, &gate, &gate + 1);
+		return;
+	}
+	std::size_t target_mask = (std::size_t)1 << gate.target;
+	if (target_mask >= count) {
+		throw std::runtime_error("Gate target outside of the amplitude block!\n");
+	}
+	std::size_t high_ctl = gate.ctl_mask & ~(count - 1), low_ctl = gate.ctl_mask & (count - 1);
+	if ((base & high_ctl) != high_ctl) {
+		return;
+	}
+	std::size_t low_bits = target_mask - 1;
+	if (gate.permutation()) {
+		for (std::size_t pair = 0; pair < count / 2; pair++) {
+			std::size_t mask0 = (pair & low_bits) | (pair & ~low_bits) << 1;
+			if ((mask0 & low_ctl) == low_ctl) {
+				std::swap(amps[mask0], amps[mask0 | target_mask]);
+			}
+		}
+		return;
+	}
+	std::array <std::complex <double>, 4> matrix = gate.matrix();
+	for (std::size_t pair = 0; pair < count / 2; pair++) {
+		std::size_t mask0 = (pair & low_bits) | (pair & ~low_bits) << 1, mask1 = mask0 | target_mask;
+		if ((mask0 & low_ctl) != low_ctl) {
+			continue;
+		}
+		std::complex <double> val0 = amps[mask0], val1 = amps[mask1];
+		amps[mask0] = matrix[0] * val0 + matrix[1] * val1;
+		amps[mask1] = matrix[2] * val0 + matrix[3] * val1;
+	}
+}
+
+/*
+ * Applies a run of permutation gates with swaps only, without any floating point work. A stretch of X and CX gates (or
+ * of gates that reduce to them, given the bits of 'base') maps the index bits of the block affinely, so the whole
+ * stretch compiles into an XOR offset plus one table per byte of the index, and its amplitudes are then moved along the
+ * cycles of that map in a single pass. If the map is a plain XOR, the cycles are just pairs. Gates with more than one
+ * control inside the block, and stretches too short to pay for the tables, are swapped one gate at a time.
+ */
+void applyPermutation(std::complex <double> *amps, std::size_t count, std::size_t base, const instruction *first, const instruction *last) {
+	auto affine = [&](const instruction &gate) {
+		std::size_t high = gate.ctl_mask & ~(count - 1), low = gate.ctl_mask & (count - 1);
+		return (base & high) != high || (low & (low - 1)) == 0;
+	};
+	while (first != last) {
+		const instruction *run_end = first;
+		while (run_end != last && affine(*run_end)) {
+			run_end++;
+		}
+		if (run_end - first < PERMUTATION_GATES) {
+			applyGate(amps, count, base, *first);
+			first++;
+			continue;
+		}
+		for (const instruction *now = first; now != run_end; now++) {
+			if ((std::size_t)1 << now->target >= count) {
+				throw std::runtime_error("Gate target outside of the amplitude block!\n");
+			}
+		}
+
+		// Image of the block's first index, and how each index bit moves it
+		std::size_t origin = permuteIndex(base, first, run_end);
+		std::size_t offset = origin ^ base;
+		std::vector <std::size_t> columns;
+		bool plain = true;
+		for (unsigned int pos = 0; (std::size_t)1 << pos < count; pos++) {
+			columns.push_back(permuteIndex(base | (std::size_t)1 << pos, first, run_end) ^ origin);
+			plain &= columns.back() == (std::size_t)1 << pos;
+		}
+		first = run_end;
+		if (plain) {
+			if (offset != 0) {
+				for (std::size_t mask = 0; mask < count; mask++) {
+					if (mask < (mask ^ offset)) {
+						std::swap(amps[mask], amps[mask ^ offset]);
+					}
+				}
+			}
+			continue;
+		}
+
+		unsigned int no_bytes = ((unsigned int)columns.size() + 7) >> 3;
+		std::vector <std::array <std::size_t, 256>> images(no_bytes);
+		for (unsigned int byte = 0; byte < no_bytes; byte++) {
+			for (unsigned int value = 0; value < 256; value++) {
+				std::size_t image = 0;
+				for (unsigned int bit = 0; bit < 8 && 8 * byte + bit < columns.size(); bit++) {
+					if (value >> bit & 1) {
+						image ^= columns[8 * byte + bit];
+					}
+				}
+				images[byte][value] = image;
+			}
+		}
+		auto image = [&](std::size_t mask) {
+			std::size_t result = offset;
+			for (unsigned int byte = 0; byte < no_bytes; byte++) {
+				result ^= images[byte][mask >> (8 * byte) & 255];
+			}
+			return result;
+		};
+		std::vector <bool> visited(count, false);
+		for (std::size_t start = 0; start < count; start++) {
+			if (visited[start]) {
+				continue;
+			}
+			std::complex <double> carried = amps[start];
+			for (std::size_t now = image(start); now != start; now = image(now)) {
+				std::swap(carried, amps[now]);
+				visited[now] = true;
+			}
+			amps[start] = carried;
+		}
+	}
+}
+
+/*
+ * Applies the instructions in [first, last) to the block, in order. Runs of consecutive diagonal gates are merged into
+ * a single phase pass and runs of consecutive permutation gates into a single permutation pass.
+ */
+void applyGates(std::complex <double> *amps, std::size_t count, std::size_t base, const instruction *first, const instruction *last) {
+	while (first != last) {
+		const instruction *run_end = first;
+		while (run_end != last && run_end->diagonal()) {
+			run_end++;
+		}
+		if (run_end != first) {
+			applyPhases(amps, count, base, first, run_end);
+			first = run_end;
+			continue;
+		}
+		while (run_end != last && run_end->permutation()) {
+			run_end++;
+		}
+		if (run_end != first) {
+			applyPermutation(amps, count, base, first, run_end);
+			first = run_end;
+		}
+		else {
+			applyGate(amps, count, base, *first);
+			first++;
+		}
+	}
+}
+
+/*
+ * Applies a single instruction to 'batch' state vectors of 'count' amplitudes each, stored interleaved: amplitude 'mask'
+ * of vector 'ind' is at amps[mask * batch + ind]. Every step of the gate is done for the whole batch in a row, over
+ * contiguous memory.
+ */
+void applyGateBatch(std::complex <double> *amps, std::size_t count, std::size_t batch, const instruction &gate) {
+	if ((std::size_t)1 << gate.target >= count || (gate.ctl_mask & ~(count - 1)) != 0) {
+		throw std::runtime_error("Gate qubit outside of the state vector!\n");
+	}
+	if (gate.diagonal()) {
+		std::size_t full = gate.mask();
+		std::complex <double> phase = std::polar(1.0, gate.phase);
+		for (std::size_t mask = 0; mask < count; mask++) {
+			if ((mask & full) == full) {
+				std::complex <double> *now = amps + mask * batch;
+				for (std::size_t ind = 0; ind < batch; ind++) {
+					now[ind] *= phase;
+				}
+			}
+		}
+		return;
+	}
+	std::size_t target_mask = (std::size_t)1 << gate.target, low_bits = target_mask - 1;
+	std::array <std::complex <double>, 4> matrix = gate.matrix();
+	for (std::size_t pair = 0; pair < count / 2; pair++) {
+		std::size_t mask0 = (pair & low_bits) | (pair & ~low_bits) << 1;
+		if ((mask0 & gate.ctl_mask) != gate.ctl_mask) {
+			continue;
+		}
+		std::complex <double> *now0 = amps + mask0 * batch, *now1 = amps + (mask0 | target_mask) * batch;
+		if (gate.permutation()) {
+			std::swap_ranges(now0, now0 + batch, now1);
+			continue;
+		}
+		for (std::size_t ind = 0; ind < batch; ind++) {
+			std::complex <double> val0 = now0[ind], val1 = now1[ind];
+			now0[ind] = matrix[0] * val0 + matrix[1] * val1;
+			now1[ind] = matrix[2] * val0 + matrix[3] * val1;
+		}
+	}
+}
+
+/*
+ * Exchanges the roles of two qubits of the block, that is swaps every pair of amplitudes whose indices differ only by
+ * having 'qubit1' and 'qubit2' the other way around
+ */
+void swapQubits(std::complex <double> *amps, std::size_t count, unsigned int qubit1, unsigned int qubit2) {
+	if (qubit1 == qubit2) {
+		return;
+	}
+	std::size_t mask1 = (std::size_t)1 << qubit1, mask2 = (std::size_t)1 << qubit2;
+	if (mask1 >= count || mask2 >= count) {
+		throw std::runtime_error("Swapped qubit outside of the amplitude block!\n");
+	}
+	for (std::size_t mask = 0; mask < count; mask++) {
+		if ((mask & mask1) && !(mask & mask2)) {
+			std::swap(amps[mask], amps[mask ^ mask1 ^ mask2]);
+		}
+	}
+}
+
+#undef PHASE_QUBITS
+#undef PERMUTATION_GATES
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <string>
+#include <stdexcept>
+#include <cstddef>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Memory mapped file. Owns both the file descriptor and the mapping and releases them on destruction. A read-only
+ * mapping exposes the whole file as is, while a writable one starts from an all zero file of the requested size. The
+ * zeros come from truncating the file, so they cost nothing until a page is first written.
+ */
+class mapping {
+private:
+	int fd = -1;
+	void *address = nullptr;
+	std::size_t length = 0;
+
+	void release();
+public:
+	mapping() = default;
+	explicit mapping(const std::string &path); // read-only, whole file
+	explicit mapping(const std::string &path, std::size_t size); // read-write, file cleared to 'size' zero bytes
+	mapping(const mapping &) = delete;
+	mapping &operator=(const mapping &) = delete;
+	mapping(mapping &&other) noexcept;
+	mapping &operator=(mapping &&other) noexcept;
+	~mapping();
+
+	void *data() const;
+	std::size_t size() const;
+
+	/*
+	 * Writes every dirty page back to the file
+	 */
+	void flush();
+};
+
+mapping::mapping(const std::string &path) {
+	fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		throw std::runtime_error("Cannot open file " + path + "!\n");
+	}
+	struct stat info;
+	if (fstat(fd, &info) < 0) {
+		release();
+		throw std::runtime_error("Cannot read the size of file " + path + "!\n");
+	}
+	length = info.st_size;
+	if (length != 0) {
+		address = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+		if (address == MAP_FAILED) {
+			address = nullptr;
+			release();
+			throw std::runtime_error("Cannot map file " + path + "!\n");
+		}
+	}
+}
+mapping::mapping(const std::string &path, std::size_t size) {
+	fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		throw std::runtime_error("Cannot open file " + path + "!\n");
+	}
+	if (ftruncate(fd, 0) < 0 || ftruncate(fd, size) < 0) {
+		release();
+		throw std::runtime_error("Cannot resize file " + path + "!\n");
+	}
+	length = size;
+	if (length != 0) {
+		address = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (address == MAP_FAILED) {
+			address = nullptr;
+			release();
+			throw std::runtime_error("Cannot map file " + path + "!\n");
+		}
+	}
+}
+mapping::mapping(mapping &&other) noexcept : fd(other.fd), address(other.address), length(other.length) {
+	other.fd = -1;
+	other.address = nullptr;
+	other.length = 0;
+}
+mapping &mapping::operator=(mapping &&other) noexcept {
+	if (this != &other) {
+		release();
+		fd = other.fd;
+		address = other.address;
+		length = other.length;
+		other.fd = -1;
+		other.address = nullptr;
+		other.length = 0;
+	}
+	return *this;
+}
+mapping::~mapping() {
+	release();
+}
+
+void mapping::release() {
+	if (address != nullptr) {
+		munmap(address, length);
+		address = nullptr;
+	}
+	if (fd >= 0) {
+		close(fd);
+		fd = -1;
+	}
+	length = 0;
+}
+
+void *mapping::data() const {
+	return address;
+}
+std::size_t mapping::size() const {
+	return length;
+}
+
+void mapping::flush() {
+	if (address != nullptr && msync(address, length, MS_SYNC) < 0) {
+		throw std::runtime_error("Cannot write the mapping back to its file!\n");
+	}
+}
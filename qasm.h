@@ -0,0 +1,412 @@
+#pragma once
+
+#include <cctype>
+#include <cmath>
+#include <istream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "circuit.h"
+
+/*
+ * Importer for a subset of OpenQASM 2. Supports qreg/creg declarations, barriers and the standard gates that have an
+ * exact equivalent in the circuit class (up to global phase for the uncontrolled ones): id, h, x, y, z, s, sdg, t, tdg,
+ * rx, ry, rz, u1, p, u2, u3, u, cx, cy, cz, crx, cry, crz, cu1, cp, ccx, swap and cswap. Gates applied to whole
+ * registers are broadcast the same way the language does. Custom gate definitions, conditionals, resets and
+ * measurements are rejected; measurements are to be done on the state class as usual.
+ */
+template <unsigned int no_qubits>
+void ReadQASM(std::istream &in, circuit <no_qubits> &into);
+
+namespace qasm {
+
+/*
+ * Recursive descent parser for the parameter expressions of a gate: numbers, pi, + - * / ^, parentheses and the
+ * unary functions sin, cos, tan, exp, ln and sqrt.
+ */
+class expression {
+private:
+	const std::string &text;
+	std::size_t pos = 0;
+
+	void skipSpaces();
+	double sum();
+	double product();
+	double power();
+	double unary();
+public:
+	explicit expression(const std::string &text);
+	double evaluate();
+};
+
+expression::expression(const std::string &text) : text(text) {}
+
+void expression::skipSpaces() {
+	while (pos < text.size() && std::isspace((unsigned char)text[pos])) {
+		pos++;
+	}
+}
+
+double expression::evaluate() {
+	double ans = sum();
+	skipSpaces();
+	if (pos != text.size()) {
+		throw std::runtime_error("Unexpected character in expression '" + text + "'!\n");
+	}
+	return ans;
+}
+
+double expression::sum() {
+	double ans = product();
+	skipSpaces();
+	while (pos < text.size() && (text[pos] == '+' || text[pos] == '-')) {
+		char op = text[pos++];
+		double rhs = product();
+		ans = op == '+' ? ans + rhs : ans - rhs;
+		skipSpaces();
+	}
+	return ans;
+}
+
+double expression::product() {
+	double ans = power();
+	skipSpaces();
+	while (pos < text.size() && (text[pos] == '*' || text[pos] == '/')) {
+		char op = text[pos++];
+		double rhs = power();
+		ans = op == '*' ? ans * rhs : ans / rhs;
+		skipSpaces();
+	}
+	return ans;
+}
+
+double expression::power() {
+	double base = unary();
+	skipSpaces();
+	if (pos < text.size() && text[pos] == '^') {
+		pos++;
+		return std::pow(base, power());
+	}
+	return base;
+}
+
+double expression::unary() {
+	skipSpaces();
+	if (pos >= text.size()) {
+		throw std::runtime_error("Unexpected end of expression '" + text + "'!\n");
+	}
+	if (text[pos] == '-') {
+		pos++;
+		return -unary();
+	}
+	if (text[pos] == '+') {
+		pos++;
+		return unary();
+	}
+	if (text[pos] == '(') {
+		pos++;
+		double ans = sum();
+		skipSpaces();
+		if (pos >= text.size() || text[pos] != ')') {
+			throw std::runtime_error("Unbalanced parentheses in expression '" + text + "'!\n");
+		}
+		pos++;
+		return ans;
+	}
+	if (std::isdigit((unsigned char)text[pos]) || text[pos] == '.') {
+		std::size_t len;
+		double ans = std::stod(text.substr(pos), &len);
+		pos += len;
+		return ans;
+	}
+	std::size_t start = pos;
+	while (pos < text.size() && std::isalnum((unsigned char)text[pos])) {
+		pos++;
+	}
+	std::string name = text.substr(start, pos - start);
+	if (name == "pi") {
+		return M_PI;
+	}
+	skipSpaces();
+	if (pos >= text.size() || text[pos] != '(') {
+		throw std::runtime_error("Unknown identifier '" + name + "' in expression!\n");
+	}
+	double arg = unary();
+	if (name == "sin") {
+		return std::sin(arg);
+	}
+	if (name == "cos") {
+		return std::cos(arg);
+	}
+	if (name == "tan") {
+		return std::tan(arg);
+	}
+	if (name == "exp") {
+		return std::exp(arg);
+	}
+	if (name == "ln") {
+		return std::log(arg);
+	}
+	if (name == "sqrt") {
+		return std::sqrt(arg);
+	}
+	throw std::runtime_error("Unknown function '" + name + "' in expression!\n");
+}
+
+std::string trim(const std::string &text) {
+	std::size_t start = 0, stop = text.size();
+	while (start < stop && std::isspace((unsigned char)text[start])) {
+		start++;
+	}
+	while (stop > start && std::isspace((unsigned char)text[stop - 1])) {
+		stop--;
+	}
+	return text.substr(start, stop - start);
+}
+
+/*
+ * Splits on every separator that is not nested inside parentheses
+ */
+std::vector <std::string> split(const std::string &text, char separator) {
+	std::vector <std::string> ans;
+	std::string now;
+	int nesting = 0;
+	for (char chr : text) {
+		if (chr == '(') {
+			nesting++;
+		}
+		else if (chr == ')') {
+			nesting--;
+		}
+		if (chr == separator && nesting == 0) {
+			ans.push_back(trim(now));
+			now.clear();
+		}
+		else {
+			now += chr;
+		}
+	}
+	if (!trim(now).empty() || !ans.empty()) {
+		ans.push_back(trim(now));
+	}
+	return ans;
+}
+
+}
+
+template <unsigned int no_qubits>
+void ReadQASM(std::istream &in, circuit <no_qubits> &into) {
+	std::string source, line;
+	while (std::getline(in, line)) {
+		std::size_t comment = line.find("//");
+		if (comment != std::string::npos) {
+			line.erase(comment);
+		}
+		source += line;
+		source += ' ';
+	}
+
+	std::map <std::string, std::pair <unsigned int, unsigned int>> registers; // name -> (first qubit, size)
+	unsigned int used_qubits = 0;
+
+	auto qubitsOf = [&](const std::string &arg) {
+		std::vector <unsigned int> ans;
+		std::size_t open = arg.find('[');
+		std::string name = qasm::trim(arg.substr(0, open));
+		auto reg = registers.find(name);
+		if (reg == registers.end()) {
+			throw std::runtime_error("Unknown quantum register '" + name + "'!\n");
+		}
+		if (open == std::string::npos) {
+			for (unsigned int ind = 0; ind < reg->second.second; ind++) {
+				ans.push_back(reg->second.first + ind);
+			}
+		}
+		else {
+			unsigned int ind = std::stoul(arg.substr(open + 1));
+			if (ind >= reg->second.second) {
+				throw std::runtime_error("Qubit index not in range for register '" + name + "'!\n");
+			}
+			ans.push_back(reg->second.first + ind);
+		}
+		return ans;
+	};
+
+	for (const std::string &statement : qasm::split(source, ';')) {
+		if (statement.empty()) {
+			continue;
+		}
+		std::size_t name_end = 0;
+		while (name_end < statement.size() && (std::isalnum((unsigned char)statement[name_end]) || statement[name_end] == '_')) {
+			name_end++;
+		}
+		std::string name = statement.substr(0, name_end);
+		std::string rest = qasm::trim(statement.substr(name_end));
+
+		if (name == "OPENQASM") {
+			if (rest.compare(0, 1, "2") != 0) {
+				throw std::runtime_error("Only OpenQASM 2 is supported!\n");
+			}
+			continue;
+		}
+		if (name == "include") {
+			if (rest != "\"qelib1.inc\"") {
+				throw std::runtime_error("Only qelib1.inc can be included!\n");
+			}
+			continue;
+		}
+		if (name == "qreg" || name == "creg") {
+			std::size_t open = rest.find('['), close = rest.find(']');
+			if (open == std::string::npos || close == std::string::npos) {
+				throw std::runtime_error("Malformed register declaration '" + statement + "'!\n");
+			}
+			if (name == "qreg") {
+				unsigned int size = std::stoul(rest.substr(open + 1));
+				registers[qasm::trim(rest.substr(0, open))] = {used_qubits, size};
+				used_qubits += size;
+				if (used_qubits > no_qubits) {
+					throw std::runtime_error("Program needs more qubits than the circuit has!\n");
+				}
+			}
+			continue;
+		}
+		if (name == "barrier") {
+			into.Bar();
+			continue;
+		}
+		if (name == "measure" || name == "reset" || name == "if" || name == "gate" || name == "opaque") {
+			throw std::runtime_error("Statement '" + name + "' is not supported, only gates can be imported!\n");
+		}
+
+		std::vector <double> params;
+		if (!rest.empty() && rest[0] == '(') {
+			std::size_t close = 0;
+			int nesting = 0;
+			for (std::size_t ind = 0; ind < rest.size(); ind++) {
+				if (rest[ind] == '(') {
+					nesting++;
+				}
+				else if (rest[ind] == ')' && --nesting == 0) {
+					close = ind;
+					break;
+				}
+			}
+			for (const std::string &param : qasm::split(rest.substr(1, close - 1), ',')) {
+				params.push_back(qasm::expression(param).evaluate());
+			}
+			rest = qasm::trim(rest.substr(close + 1));
+		}
+		std::vector <std::vector <unsigned int>> args;
+		for (const std::string &arg : qasm::split(rest, ',')) {
+			args.push_back(qubitsOf(arg));
+		}
+
+		static const std::map <std::string, std::pair <unsigned int, unsigned int>> arity = { // name -> (params, qubits)
+			{"id", {0, 1}}, {"u0", {1, 1}}, {"h", {0, 1}}, {"x", {0, 1}}, {"y", {0, 1}}, {"z", {0, 1}},
+			{"s", {0, 1}}, {"sdg", {0, 1}}, {"t", {0, 1}}, {"tdg", {0, 1}},
+			{"rx", {1, 1}}, {"ry", {1, 1}}, {"rz", {1, 1}}, {"u1", {1, 1}}, {"p", {1, 1}},
+			{"u2", {2, 1}}, {"u3", {3, 1}}, {"u", {3, 1}}, {"U", {3, 1}},
+			{"cx", {0, 2}}, {"CX", {0, 2}}, {"cy", {0, 2}}, {"cz", {0, 2}},
+			{"crx", {1, 2}}, {"cry", {1, 2}}, {"crz", {1, 2}}, {"cu1", {1, 2}}, {"cp", {1, 2}},
+			{"swap", {0, 2}}, {"ccx", {0, 3}}, {"cswap", {0, 3}},
+		};
+		auto gate = arity.find(name);
+		if (gate == arity.end()) {
+			throw std::runtime_error("Gate '" + name + "' is not supported!\n");
+		}
+		if (params.size() != gate->second.first || args.size() != gate->second.second) {
+			throw std::runtime_error("Wrong number of arguments for gate '" + name + "'!\n");
+		}
+
+		std::size_t repeat = 1;
+		for (const std::vector <unsigned int> &arg : args) {
+			if (arg.size() != 1) {
+				if (repeat != 1 && repeat != arg.size()) {
+					throw std::runtime_error("Registers of different sizes given to gate '" + name + "'!\n");
+				}
+				repeat = arg.size();
+			}
+		}
+		for (std::size_t ind = 0; ind < repeat; ind++) {
+			std::vector <unsigned int> q;
+			for (const std::vector <unsigned int> &arg : args) {
+				q.push_back(arg.size() == 1 ? arg[0] : arg[ind]);
+			}
+			if (name == "h") {
+				into.H(q[0]);
+			}
+			else if (name == "x") {
+				into.X(q[0]);
+			}
+			else if (name == "y") {
+				into.Y(q[0]);
+			}
+			else if (name == "z") {
+				into.Z(q[0]);
+			}
+			else if (name == "s" || name == "sdg" || name == "t" || name == "tdg") {
+				double phase = name[0] == 's' ? M_PI / 2 : M_PI / 4;
+				into.RZ(q[0], name.size() == 3 ? -phase : phase);
+			}
+			else if (name == "rx") {
+				into.RX(q[0], params[0]);
+			}
+			else if (name == "ry") {
+				into.RY(q[0], params[0]);
+			}
+			else if (name == "rz" || name == "u1" || name == "p") {
+				into.RZ(q[0], params[0]);
+			}
+			else if (name == "u2") {
+				into.RZ(q[0], params[1]);
+				into.RY(q[0], M_PI / 2);
+				into.RZ(q[0], params[0]);
+			}
+			else if (name == "u3" || name == "u" || name == "U") {
+				into.RZ(q[0], params[2]);
+				into.RY(q[0], params[0]);
+				into.RZ(q[0], params[1]);
+			}
+			else if (name == "cx" || name == "CX") {
+				into.CX(q[0], q[1]);
+			}
+			else if (name == "cy") {
+				into.CY(q[0], q[1]);
+			}
+			else if (name == "cz") {
+				into.CZ(q[0], q[1]);
+			}
+			else if (name == "cu1" || name == "cp") {
+				into.CRZ(q[0], q[1], params[0]);
+			}
+			else if (name == "crx" || name == "cry" || name == "crz") {
+				// The circuit rotations carry an extra e^(i*phase/2), which becomes a relative phase once controlled
+				if (name == "crx") {
+					into.CRX(q[0], q[1], params[0]);
+				}
+				else if (name == "cry") {
+					into.CRY(q[0], q[1], params[0]);
+				}
+				else {
+					into.CRZ(q[0], q[1], params[0]);
+				}
+				into.RZ(q[0], -params[0] / 2);
+			}
+			else if (name == "swap") {
+				into.CX(q[0], q[1]);
+				into.CX(q[1], q[0]);
+				into.CX(q[0], q[1]);
+			}
+			else if (name == "ccx") {
+				into.CCX({q[0], q[1]}, q[2]);
+			}
+			else if (name == "cswap") {
+				into.CX(q[2], q[1]);
+				into.CCX({q[0], q[1]}, q[2]);
+				into.CX(q[2], q[1]);
+			}
+		}
+	}
+}
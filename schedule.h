@@ -0,0 +1,183 @@
+#pragma once
+
+#include <complex>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <unistd.h>
+
+#include "instruction.h"
+#include "kernel.h"
+
+/*
+ * Picks which of the qubits at physical positions [0, candidates) to move out to make room for another one: the one
+ * whose next use as the target of a non diagonal gate in [now, last) is the furthest away. 'who' maps physical to
+ * logical qubits.
+ */
+unsigned int evictionVictim(const instruction *now, const instruction *last, const std::vector <unsigned int> &who, unsigned int candidates) {
+	unsigned int victim = 0;
+	std::ptrdiff_t furthest = -1;
+	for (unsigned int pos = 0; pos < candidates; pos++) {
+		const instruction *next = now;
+		while (next != last && (next->target != who[pos] || next->diagonal())) {
+			next++;
+		}
+		if (next - now > furthest) {
+			furthest = next - now;
+			victim = pos;
+		}
+	}
+	return victim;
+}
+
+/*
+ * Cache blocked execution plan of a list of instructions. The gates are partitioned into segments whose targets all lie
+ * below 'block_qubits'; every gate of a segment is applied to one cache sized block of amplitudes before moving on to
+ * the next block, so a segment costs a single sweep over the state vector instead of one per gate. Diagonal gates fit
+ * in any segment, wherever their qubits are. Any other gate on a higher qubit either gets a sweep of its own or, if that
+ * qubit is about to be used again, first has the qubit swapped with a local one. The plan keeps track of where every
+ * qubit ended up and swaps them back at the end.
+ */
+class schedule {
+public:
+	struct step {
+		char kind; // 'b' for a blocked segment, 'g' for a single gate sweep, 's' for a swap of two qubits
+		std::size_t first, last; // gates of a segment or the single gate, as a range in 'gates'
+		unsigned int qubit1, qubit2; // the two swapped qubits
+	};
+private:
+	std::vector <instruction> gates;
+	std::vector <step> steps;
+	unsigned int block_qubits = 0;
+
+	/*
+	 * A swap costs 2 sweeps (one now, one to undo it), so a high qubit is only brought down if it is the target of at
+	 * least this many gates in the next 'lookahead' ones
+	 */
+	static constexpr unsigned int lookahead = 32;
+	static constexpr unsigned int min_uses = 3;
+
+	void pushGate(const instruction &gate, char kind);
+	void pushSwap(unsigned int qubit1, unsigned int qubit2);
+public:
+	/*
+	 * Number of qubits of a block that fits comfortably (in half) in the L2 cache
+	 */
+	static unsigned int cacheQubits();
+
+	schedule() = default;
+	explicit schedule(const instruction *first, const instruction *last, unsigned int no_qubits, unsigned int local_qubits = cacheQubits());
+
+	/*
+	 * Runs the plan on a state vector of 'count' amplitudes. Qubits above the state vector, if the instructions use
+	 * any, are read from 'base'.
+	 */
+	void run(std::complex <double> *amps, std::size_t count, std::size_t base = 0) const;
+
+	/*
+	 * Number of sweeps over the state vector the plan takes
+	 */
+	std::size_t sweeps() const;
+};
+
+unsigned int schedule::cacheQubits() {
+	long cache = 0;
+#ifdef _SC_LEVEL2_CACHE_SIZE
+	cache = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+	if (cache <= 0) {
+		cache = 256 * 1024;
+	}
+	unsigned int qubits = 0;
+	while (((std::size_t)sizeof(std::complex <double>) << (qubits + 1)) <= (std::size_t)cache / 2) {
+		qubits++;
+	}
+	return qubits;
+}
+
+void schedule::pushGate(const instruction &gate, char kind) {
+	if (kind == 'b' && !steps.empty() && steps.back().kind == 'b' && steps.back().last == gates.size()) {
+		steps.back().last++;
+	}
+	else {
+		steps.push_back({kind, gates.size(), gates.size() + 1, 0, 0});
+	}
+	gates.push_back(gate);
+}
+void schedule::pushSwap(unsigned int qubit1, unsigned int qubit2) {
+	steps.push_back({'s', gates.size(), gates.size(), qubit1, qubit2});
+}
+
+schedule::schedule(const instruction *first, const instruction *last, unsigned int no_qubits, unsigned int local_qubits) {
+	block_qubits = local_qubits < no_qubits ? local_qubits : no_qubits;
+	std::vector <unsigned int> where(no_qubits), who(no_qubits); // logical -> physical and physical -> logical qubit
+	for (unsigned int pos = 0; pos < no_qubits; pos++) {
+		where[pos] = who[pos] = pos;
+	}
+	for (const instruction *now = first; now != last; now++) {
+		if (now->target >= no_qubits && !now->diagonal()) {
+			throw std::runtime_error("Qubit index not in range!\n");
+		}
+		if (!now->diagonal() && where[now->target] >= block_qubits) {
+			const instruction *window = last - now > (std::ptrdiff_t)lookahead ? now + lookahead : last;
+			unsigned int uses = 0;
+			for (const instruction *next = now; next != window; next++) {
+				uses += next->target == now->target && !next->diagonal();
+			}
+			if (uses >= min_uses) {
+				unsigned int victim = evictionVictim(now, window, who, block_qubits);
+				unsigned int high = where[now->target];
+				pushSwap(victim, high);
+				std::swap(who[victim], who[high]);
+				where[who[victim]] = victim;
+				where[who[high]] = high;
+			}
+		}
+		// Qubits above the state vector are left alone, the kernels read them from the base index
+		instruction gate = *now;
+		gate.target = now->target < no_qubits ? where[now->target] : now->target;
+		gate.ctl_mask = no_qubits < 64 ? now->ctl_mask >> no_qubits << no_qubits : 0;
+		for (unsigned int pos = 0; pos < no_qubits; pos++) {
+			if (now->ctl_mask & (std::uint64_t)1 << pos) {
+				gate.ctl_mask |= (std::uint64_t)1 << where[pos];
+			}
+		}
+		pushGate(gate, gate.target < block_qubits || gate.diagonal() ? 'b' : 'g');
+	}
+	for (unsigned int pos = 0; pos < no_qubits; pos++) {
+		if (who[pos] != pos) {
+			unsigned int other = where[pos];
+			pushSwap(pos, other);
+			std::swap(who[pos], who[other]);
+			where[who[pos]] = pos;
+			where[who[other]] = other;
+		}
+	}
+}
+
+void schedule::run(std::complex <double> *amps, std::size_t count, std::size_t base) const {
+	std::size_t block = (std::size_t)1 << block_qubits;
+	if (block > count) {
+		throw std::runtime_error("Schedule was made for a larger state vector!\n");
+	}
+	for (const step &now : steps) {
+		switch (now.kind) {
+		case 'b':
+			for (std::size_t offset = 0; offset < count; offset += block) {
+				applyGates(amps + offset, block, base + offset, gates.data() + now.first, gates.data() + now.last);
+			}
+			break;
+		case 'g':
+			applyGate(amps, count, base, gates[now.first]);
+			break;
+		case 's':
+			swapQubits(amps, count, now.qubit1, now.qubit2);
+			break;
+		}
+	}
+}
+
+std::size_t schedule::sweeps() const {
+	return steps.size();
+}
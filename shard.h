@@ -0,0 +1,430 @@
+#pragma once
+
+#include <cerrno>
+#include <complex>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <functional>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "circuit.h"
+
+/*
+ * Link between the worker processes of a sharded state. Implementations only have to move bytes between two workers;
+ * the collective operations are built on top of that, with worker 0 as the root.
+ */
+class transport {
+public:
+	virtual ~transport() = default;
+
+	virtual unsigned int rank() const = 0;
+	virtual unsigned int size() const = 0;
+
+	virtual void send(unsigned int peer, const void *data, std::size_t bytes) = 0;
+	virtual void receive(unsigned int peer, void *data, std::size_t bytes) = 0;
+
+	/*
+	 * Sends 'bytes' bytes to 'peer' while receiving as many from it. Both workers have to call it.
+	 */
+	virtual void exchange(unsigned int peer, const void *send_data, void *receive_data, std::size_t bytes) = 0;
+
+	/*
+	 * Collective operations. Every worker has to call them, in the same order.
+	 */
+	double sum(double value);
+	void broadcast(void *data, std::size_t bytes);
+	void barrier();
+};
+
+double transport::sum(double value) {
+	if (rank() == 0) {
+		for (unsigned int peer = 1; peer < size(); peer++) {
+			double part;
+			receive(peer, &part, sizeof(part));
+			value += part;
+		}
+	}
+	else {
+		send(0, &value, sizeof(value));
+	}
+	broadcast(&value, sizeof(value));
+	return value;
+}
+void transport::broadcast(void *data, std::size_t bytes) {
+	if (rank() == 0) {
+		for (unsigned int peer = 1; peer < size(); peer++) {
+			send(peer, data, bytes);
+		}
+	}
+	else {
+		receive(0, data, bytes);
+	}
+}
+void transport::barrier() {
+	sum(0);
+}
+
+/*
+ * Transport over Unix domain sockets between processes forked on the same machine. Every pair of workers has its own
+ * socket pair, created before forking.
+ */
+class socket_transport : public transport {
+private:
+	unsigned int my_rank;
+	std::vector <int> sockets; // socket to every other worker, -1 for itself
+public:
+	explicit socket_transport(unsigned int rank, std::vector <int> sockets);
+	socket_transport(const socket_transport &) = delete;
+	socket_transport &operator=(const socket_transport &) = delete;
+	~socket_transport() override;
+
+	unsigned int rank() const override;
+	unsigned int size() const override;
+	void send(unsigned int peer, const void *data, std::size_t bytes) override;
+	void receive(unsigned int peer, void *data, std::size_t bytes) override;
+	void exchange(unsigned int peer, const void *send_data, void *receive_data, std::size_t bytes) override;
+};
+
+socket_transport::socket_transport(unsigned int rank, std::vector <int> sockets) : my_rank(rank), sockets(std::move(sockets)) {}
+socket_transport::~socket_transport() {
+	for (int fd : sockets) {
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+}
+
+unsigned int socket_transport::rank() const {
+	return my_rank;
+}
+unsigned int socket_transport::size() const {
+	return sockets.size();
+}
+
+void socket_transport::send(unsigned int peer, const void *data, std::size_t bytes) {
+	exchange(peer, data, nullptr, bytes);
+}
+void socket_transport::receive(unsigned int peer, void *data, std::size_t bytes) {
+	exchange(peer, nullptr, data, bytes);
+}
+void socket_transport::exchange(unsigned int peer, const void *send_data, void *receive_data, std::size_t bytes) {
+	if (peer >= sockets.size() || peer == my_rank) {
+		throw std::runtime_error("Invalid worker to exchange data with!\n");
+	}
+	const char *out = static_cast <const char *>(send_data);
+	char *in = static_cast <char *>(receive_data);
+	std::size_t sent = out == nullptr ? bytes : 0, received = in == nullptr ? bytes : 0;
+	while (sent < bytes || received < bytes) {
+		pollfd request = {sockets[peer], 0, 0};
+		request.events = (sent < bytes ? POLLOUT : 0) | (received < bytes ? POLLIN : 0);
+		if (poll(&request, 1, -1) < 0) {
+			throw std::runtime_error("Cannot wait for another worker!\n");
+		}
+		if ((request.revents & POLLIN) && received < bytes) {
+			ssize_t len = read(sockets[peer], in + received, bytes - received);
+			if (len <= 0) {
+				throw std::runtime_error("Lost connection to another worker!\n");
+			}
+			received += len;
+		}
+		else if ((request.revents & POLLOUT) && sent < bytes) {
+			// A blocking write would wait for the whole buffer and deadlock two workers sending to each other
+			ssize_t len = ::send(sockets[peer], out + sent, bytes - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+			if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+				throw std::runtime_error("Lost connection to another worker!\n");
+			}
+			sent += len > 0 ? len : 0;
+		}
+		else if (request.revents & (POLLHUP | POLLERR)) {
+			throw std::runtime_error("Lost connection to another worker!\n");
+		}
+	}
+}
+
+/*
+ * Forks 'workers' - 1 processes and runs 'body' on each of them and on the calling process, which becomes worker 0.
+ * Returns once every worker finished and throws if any of them failed.
+ */
+void RunSharded(unsigned int workers, const std::function <void(transport &)> &body) {
+	std::vector <std::vector <int>> sockets(workers, std::vector <int>(workers, -1));
+	for (unsigned int rank1 = 0; rank1 < workers; rank1++) {
+		for (unsigned int rank2 = rank1 + 1; rank2 < workers; rank2++) {
+			int pair[2];
+			if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+				throw std::runtime_error("Cannot connect the workers!\n");
+			}
+			sockets[rank1][rank2] = pair[0];
+			sockets[rank2][rank1] = pair[1];
+		}
+	}
+	auto closeOthers = [&](unsigned int rank) {
+		for (unsigned int other = 0; other < workers; other++) {
+			for (int fd : sockets[other]) {
+				if (other != rank && fd >= 0) {
+					close(fd);
+				}
+			}
+		}
+	};
+
+	// Anything still buffered would otherwise be written once by every worker
+	std::cout.flush();
+	std::fflush(nullptr);
+	std::vector <pid_t> children;
+	for (unsigned int rank = 1; rank < workers; rank++) {
+		pid_t pid = fork();
+		if (pid < 0) {
+			throw std::runtime_error("Cannot fork a worker!\n");
+		}
+		if (pid == 0) {
+			int status = 0;
+			closeOthers(rank);
+			try {
+				socket_transport link(rank, sockets[rank]);
+				body(link);
+			}
+			catch (const std::exception &error) {
+				std::cerr << "Worker " << rank << ": " << error.what();
+				status = 1;
+			}
+			_exit(status);
+		}
+		children.push_back(pid);
+	}
+
+	closeOthers(0);
+	std::exception_ptr error;
+	{
+		socket_transport link(0, sockets[0]);
+		try {
+			body(link);
+		}
+		catch (...) {
+			error = std::current_exception();
+		}
+	}
+	bool failed = false;
+	for (pid_t pid : children) {
+		int status;
+		if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			failed = true;
+		}
+	}
+	if (error) {
+		std::rethrow_exception(error);
+	}
+	if (failed) {
+		throw std::runtime_error("A sharded worker failed!\n");
+	}
+}
+
+/*
+ * State vector split across the workers of a transport by its top log2(workers) qubits, the 'global' ones. Every worker
+ * keeps the amplitudes whose global qubits spell out its rank. Gates on local qubits, and diagonal gates on any qubit,
+ * run independently on every worker, while any other gate targeting a global qubit first has that qubit swapped with
+ * a local one, which exchanges half of the amplitudes between pairs of workers. Qubits stay where they were swapped to
+ * until they are needed elsewhere.
+ * Every method has to be called by all the workers, in the same order.
+ */
+template <unsigned int no_qubits>
+class sharded_state {
+private:
+	transport &link;
+	unsigned int local_qubits;
+	amplitudes state_vector;
+	double norm_factor;
+	std::vector <unsigned int> where, who; // logical -> physical and physical -> logical qubit
+
+	/*
+	 * Amplitudes are traded through a reused buffer of this many amplitudes each way (4 MiB), so a swap never needs
+	 * more than a fixed amount of memory on top of the shard itself
+	 */
+	static constexpr std::size_t exchange_amplitudes = (std::size_t)1 << 18;
+	std::vector <std::complex <double>> outgoing, incoming;
+
+	void swapGlobal(unsigned int local, unsigned int global);
+	void applyLocal(std::vector <instruction> &gates);
+	std::size_t logicalIndex(std::size_t physical) const;
+public:
+	explicit sharded_state(transport &link);
+
+	/*
+	 * Runs compiled instructions, or a whole circuit, on the sharded state
+	 */
+	void apply(const instruction *first, const instruction *last);
+	void apply(circuit <no_qubits> &program);
+
+	/*
+	 * Measures one qubit on all the workers at once. Worker 0 draws the random number.
+	 */
+	bool measure(unsigned int id);
+
+	/*
+	 * Gathers the whole state vector, in the usual qubit order, on worker 0. Returns an empty vector on the others.
+	 */
+	std::vector <std::complex <double>> getState();
+};
+
+template <unsigned int no_qubits>
+sharded_state <no_qubits>::sharded_state(transport &link) : link(link), local_qubits(no_qubits), state_vector(0), where(no_qubits), who(no_qubits) {
+	unsigned int global_qubits = 0;
+	while (((unsigned int)1 << global_qubits) < link.size()) {
+		global_qubits++;
+	}
+	if (((unsigned int)1 << global_qubits) != link.size() || global_qubits >= no_qubits) {
+		throw std::runtime_error("A sharded state needs a power of 2 workers, each with at least one local qubit!\n");
+	}
+	local_qubits = no_qubits - global_qubits;
+	state_vector = amplitudes((std::size_t)1 << local_qubits);
+	if (link.rank() == 0) {
+		state_vector[0] = 1;
+	}
+	norm_factor = 1;
+	for (unsigned int pos = 0; pos < no_qubits; pos++) {
+		where[pos] = who[pos] = pos;
+	}
+}
+
+template <unsigned int no_qubits>
+void sharded_state <no_qubits>::swapGlobal(unsigned int local, unsigned int global) {
+	std::size_t local_mask = (std::size_t)1 << local;
+	unsigned int rank_bit = link.rank() >> (global - local_qubits) & 1;
+	unsigned int peer = link.rank() ^ 1u << (global - local_qubits);
+	// This worker keeps the amplitudes whose local bit equals its global bit and trades the rest with its peer, in
+	// increasing index order on both sides, one chunk at a time
+	std::size_t traded = state_vector.size() / 2;
+	std::size_t chunk = traded < exchange_amplitudes ? traded : exchange_amplitudes;
+	outgoing.resize(chunk);
+	incoming.resize(chunk);
+	std::size_t send_mask = 0, receive_mask = 0;
+	for (std::size_t done = 0; done < traded; done += chunk) {
+		for (std::size_t ind = 0; ind < chunk; send_mask++) {
+			if (((send_mask & local_mask) != 0) != rank_bit) {
+				outgoing[ind++] = state_vector[send_mask];
+			}
+		}
+		link.exchange(peer, outgoing.data(), incoming.data(), chunk * sizeof(std::complex <double>));
+		for (std::size_t ind = 0; ind < chunk; receive_mask++) {
+			if (((receive_mask & local_mask) != 0) != rank_bit) {
+				state_vector[receive_mask] = incoming[ind++];
+			}
+		}
+	}
+	std::swap(who[local], who[global]);
+	where[who[local]] = local;
+	where[who[global]] = global;
+}
+
+template <unsigned int no_qubits>
+void sharded_state <no_qubits>::applyLocal(std::vector <instruction> &gates) {
+	if (!gates.empty()) {
+		schedule(gates.data(), gates.data() + gates.size(), local_qubits).run(state_vector.data(), state_vector.size(), (std::size_t)link.rank() << local_qubits);
+		gates.clear();
+	}
+}
+
+template <unsigned int no_qubits>
+void sharded_state <no_qubits>::apply(const instruction *first, const instruction *last) {
+	std::vector <instruction> pending;
+	for (const instruction *now = first; now != last; now++) {
+		if (!now->diagonal() && where[now->target] >= local_qubits) {
+			applyLocal(pending);
+			swapGlobal(evictionVictim(now, last, who, local_qubits), where[now->target]);
+		}
+		// Global qubits keep their physical position, the kernels read them from the rank
+		instruction gate = *now;
+		gate.target = where[now->target];
+		gate.ctl_mask = 0;
+		for (unsigned int pos = 0; pos < no_qubits; pos++) {
+			if (now->ctl_mask & (std::uint64_t)1 << pos) {
+				gate.ctl_mask |= (std::uint64_t)1 << where[pos];
+			}
+		}
+		pending.push_back(gate);
+	}
+	applyLocal(pending);
+}
+template <unsigned int no_qubits>
+void sharded_state <no_qubits>::apply(circuit <no_qubits> &program) {
+	const std::vector <instruction> &gates = program.Instructions();
+	apply(gates.data(), gates.data() + gates.size());
+}
+
+template <unsigned int no_qubits>
+bool sharded_state <no_qubits>::measure(unsigned int id) {
+	if (id >= no_qubits) {
+		throw std::runtime_error("Qubit index not in range!\n");
+	}
+	unsigned int pos = where[id];
+	std::size_t full = (std::size_t)link.rank() << local_qubits;
+	double local_total = 0, local_one = 0;
+	for (std::size_t mask = 0; mask < state_vector.size(); mask++) {
+		double prob = std::norm(state_vector[mask]);
+		local_total += prob;
+		if ((full | mask) >> pos & 1) {
+			local_one += prob;
+		}
+	}
+	double total = link.sum(local_total), one = link.sum(local_one);
+	double chosen_num = 0;
+	if (link.rank() == 0) {
+		std::random_device rand_device;
+		std::default_random_engine rand_generator(rand_device());
+		std::uniform_real_distribution<double> distribution(0, total);
+		chosen_num = distribution(rand_generator);
+	}
+	link.broadcast(&chosen_num, sizeof(chosen_num));
+	bool result = chosen_num < one;
+	for (std::size_t mask = 0; mask < state_vector.size(); mask++) {
+		if (((full | mask) >> pos & 1) != result) {
+			state_vector[mask] = 0;
+		}
+	}
+	norm_factor = result ? one : total - one;
+	return result;
+}
+
+template <unsigned int no_qubits>
+std::size_t sharded_state <no_qubits>::logicalIndex(std::size_t physical) const {
+	std::size_t ans = 0;
+	for (unsigned int pos = 0; pos < no_qubits; pos++) {
+		if (physical >> pos & 1) {
+			ans |= (std::size_t)1 << who[pos];
+		}
+	}
+	return ans;
+}
+
+template <unsigned int no_qubits>
+std::vector <std::complex <double>> sharded_state <no_qubits>::getState() {
+	std::vector <std::complex <double>> ans;
+	if (link.rank() != 0) {
+		link.send(0, state_vector.data(), state_vector.size() * sizeof(std::complex <double>));
+		return ans;
+	}
+	ans.resize((std::size_t)1 << no_qubits);
+	std::vector <std::complex <double>> part(state_vector.size());
+	double sqrt_norm = std::sqrt(norm_factor);
+	for (unsigned int peer = 0; peer < link.size(); peer++) {
+		if (peer == 0) {
+			std::copy(state_vector.begin(), state_vector.end(), part.begin());
+		}
+		else {
+			link.receive(peer, part.data(), part.size() * sizeof(std::complex <double>));
+		}
+		std::size_t base = (std::size_t)peer << local_qubits;
+		for (std::size_t mask = 0; mask < part.size(); mask++) {
+			ans[logicalIndex(base | mask)] = part[mask] / sqrt_norm;
+		}
+	}
+	return ans;
+}
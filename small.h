@@ -0,0 +1,330 @@
+#pragma once
+
+#include <array>
+#include <complex>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <random>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "circuit.h"
+
+/*
+ * Largest register the small engine is specialised for. Its kernels are unrolled over every amplitude, so their size
+ * grows with the state vector.
+ */
+#define SMALL_QUBITS 8
+
+template <unsigned int no_qubits>
+class small_circuit;
+
+/*
+ * State vector of a register small enough to live on the stack. Meant for tiny circuits that are run a huge number of
+ * times: creating, running and measuring one never touches the heap.
+ */
+template <unsigned int no_qubits>
+class small_state {
+	static_assert(no_qubits >= 1 && no_qubits <= SMALL_QUBITS, "Small states are made for registers of 1 to 8 qubits!");
+private:
+	std::array <std::complex <double>, (std::size_t)1 << no_qubits> state_vector;
+	double norm_factor;
+
+	std::size_t get_random_state();
+
+	friend class small_circuit <no_qubits>;
+public:
+	small_state();
+
+	/*
+	 * Sets the state back to all qubits 0
+	 */
+	void reset();
+	unsigned int size() const;
+
+	/*
+	 * returns the current state vector
+	 */
+	std::array <std::complex <double>, (std::size_t)1 << no_qubits> getState() const;
+
+	/*
+	 * Measures one or more qubits and modifies the state, just like state::measure. Several readings are returned as a
+	 * mask, with bit 'ind' holding the reading of 'ids[ind]'.
+	 */
+	bool measure(unsigned int id);
+	std::uint32_t measure(std::initializer_list <unsigned int> ids);
+};
+
+/*
+ * A circuit compiled for small_state. Every gate is turned into a call to a kernel specialised for its target qubit,
+ * whose amplitude indices are generated at compile time and whose loop is fully unrolled. Runs of diagonal gates are
+ * merged into a single table of phases, and runs of X, CX and CCX gates into a single table of indices.
+ * Compiling allocates; applying the result does not.
+ */
+template <unsigned int no_qubits>
+class small_circuit {
+	static_assert(no_qubits >= 1 && no_qubits <= SMALL_QUBITS, "Small circuits are made for registers of 1 to 8 qubits!");
+private:
+	static constexpr std::size_t no_states = (std::size_t)1 << no_qubits;
+
+	struct operation;
+	using kernel = void (*)(std::complex <double> *amps, const small_circuit &from, const operation &now);
+	struct operation {
+		kernel run;
+		std::uint32_t ctl_mask; // controls of a single gate
+		std::uint32_t table; // index into 'phases' or 'orders' for a merged run
+		std::array <std::complex <double>, 4> matrix;
+	};
+
+	/*
+	 * Indices of the first amplitude of every pair a gate on 'target' mixes, generated at compile time
+	 */
+	template <unsigned int target>
+	struct pair_list {
+		std::uint16_t index[no_states / 2];
+		constexpr pair_list() : index() {
+			for (std::size_t pair = 0; pair < no_states / 2; pair++) {
+				std::size_t low_bits = ((std::size_t)1 << target) - 1;
+				index[pair] = (std::uint16_t)((pair & low_bits) | (pair & ~low_bits) << 1);
+			}
+		}
+	};
+
+	std::vector <operation> operations;
+	std::vector <std::array <std::complex <double>, no_states>> phases;
+	std::vector <std::array <std::uint8_t, no_states>> orders;
+
+	template <unsigned int target, std::size_t... pairs>
+	static void gateKernel(std::complex <double> *amps, const small_circuit &from, const operation &now);
+	template <unsigned int target, std::size_t... pairs>
+	static void swapKernel(std::complex <double> *amps, const small_circuit &from, const operation &now);
+	template <std::size_t... masks>
+	static void phaseKernel(std::complex <double> *amps, const small_circuit &from, const operation &now);
+	template <std::size_t... masks>
+	static void orderKernel(std::complex <double> *amps, const small_circuit &from, const operation &now);
+
+	template <std::size_t... targets>
+	static kernel gateKernelOf(unsigned int target, std::index_sequence <targets...>);
+	template <std::size_t... targets>
+	static kernel swapKernelOf(unsigned int target, std::index_sequence <targets...>);
+	template <unsigned int target, std::size_t... pairs>
+	static constexpr kernel gateKernelFor(std::index_sequence <pairs...>);
+	template <unsigned int target, std::size_t... pairs>
+	static constexpr kernel swapKernelFor(std::index_sequence <pairs...>);
+	template <std::size_t... masks>
+	static constexpr kernel phaseKernelFor(std::index_sequence <masks...>);
+	template <std::size_t... masks>
+	static constexpr kernel orderKernelFor(std::index_sequence <masks...>);
+public:
+	explicit small_circuit(const circuit <no_qubits> &from);
+
+	/*
+	 * Applies the circuit to the state
+	 */
+	void Apply(small_state <no_qubits> &init) const;
+
+	/*
+	 * Number of kernel calls a run of the circuit takes
+	 */
+	std::size_t Size() const;
+};
+
+template <unsigned int no_qubits>
+small_state <no_qubits>::small_state() {
+	reset();
+}
+template <unsigned int no_qubits>
+void small_state <no_qubits>::reset() {
+	state_vector.fill(0);
+	state_vector[0] = 1;
+	norm_factor = 1;
+}
+template <unsigned int no_qubits>
+unsigned int small_state <no_qubits>::size() const {
+	return no_qubits;
+}
+
+template <unsigned int no_qubits>
+std::array <std::complex <double>, (std::size_t)1 << no_qubits> small_state <no_qubits>::getState() const {
+	std::array <std::complex <double>, (std::size_t)1 << no_qubits> ans;
+	double sqrt_norm = std::sqrt(norm_factor);
+	for (std::size_t mask = 0; mask < ans.size(); mask++) {
+		ans[mask] = state_vector[mask] / sqrt_norm;
+	}
+	return ans;
+}
+
+template <unsigned int no_qubits>
+std::size_t small_state <no_qubits>::get_random_state() {
+	// Seeding once per thread keeps the random device out of the per shot cost
+	static thread_local std::default_random_engine rand_generator(std::random_device{}());
+	std::uniform_real_distribution <double> distribution(0, norm_factor);
+	double chosen_num = distribution(rand_generator);
+	std::size_t chosen_state = 0;
+	while (chosen_state + 1 < state_vector.size()) {
+		chosen_num -= std::norm(state_vector[chosen_state]);
+		if (chosen_num < 0) {
+			break;
+		}
+		chosen_state++;
+	}
+	return chosen_state;
+}
+template <unsigned int no_qubits>
+bool small_state <no_qubits>::measure(unsigned int id) {
+	return measure({id}) != 0;
+}
+template <unsigned int no_qubits>
+std::uint32_t small_state <no_qubits>::measure(std::initializer_list <unsigned int> ids) {
+	std::size_t read_mask = 0;
+	for (unsigned int value : ids) {
+		if (value >= no_qubits) {
+			throw std::runtime_error("Qubit index not in range!\n");
+		}
+		read_mask |= (std::size_t)1 << value;
+	}
+	std::size_t chosen_state = get_random_state();
+	std::size_t rez_mask = chosen_state & read_mask;
+	norm_factor = 0;
+	for (std::size_t mask = 0; mask < state_vector.size(); mask++) {
+		if ((mask & read_mask) == rez_mask) {
+			norm_factor += std::norm(state_vector[mask]);
+		}
+		else {
+			state_vector[mask] = 0;
+		}
+	}
+	std::uint32_t ans = 0, ind = 0;
+	for (unsigned int value : ids) {
+		ans |= (std::uint32_t)(chosen_state >> value & 1) << ind++;
+	}
+	return ans;
+}
+
+template <unsigned int no_qubits>
+template <unsigned int target, std::size_t... pairs>
+void small_circuit <no_qubits>::gateKernel(std::complex <double> *amps, const small_circuit &, const operation &now) {
+	static constexpr pair_list <target> list;
+	auto mix = [&](std::size_t mask0) {
+		if ((mask0 & now.ctl_mask) == now.ctl_mask) {
+			std::size_t mask1 = mask0 | (std::size_t)1 << target;
+			std::complex <double> val0 = amps[mask0], val1 = amps[mask1];
+			amps[mask0] = now.matrix[0] * val0 + now.matrix[1] * val1;
+			amps[mask1] = now.matrix[2] * val0 + now.matrix[3] * val1;
+		}
+	};
+	(void)std::initializer_list <int>{(mix(list.index[pairs]), 0)...};
+}
+template <unsigned int no_qubits>
+template <unsigned int target, std::size_t... pairs>
+void small_circuit <no_qubits>::swapKernel(std::complex <double> *amps, const small_circuit &, const operation &now) {
+	static constexpr pair_list <target> list;
+	auto flip = [&](std::size_t mask0) {
+		if ((mask0 & now.ctl_mask) == now.ctl_mask) {
+			std::swap(amps[mask0], amps[mask0 | (std::size_t)1 << target]);
+		}
+	};
+	(void)std::initializer_list <int>{(flip(list.index[pairs]), 0)...};
+}
+template <unsigned int no_qubits>
+template <std::size_t... masks>
+void small_circuit <no_qubits>::phaseKernel(std::complex <double> *amps, const small_circuit &from, const operation &now) {
+	const std::array <std::complex <double>, no_states> &table = from.phases[now.table];
+	(void)std::initializer_list <int>{(amps[masks] *= table[masks], 0)...};
+}
+template <unsigned int no_qubits>
+template <std::size_t... masks>
+void small_circuit <no_qubits>::orderKernel(std::complex <double> *amps, const small_circuit &from, const operation &now) {
+	const std::array <std::uint8_t, no_states> &table = from.orders[now.table];
+	std::array <std::complex <double>, no_states> moved;
+	(void)std::initializer_list <int>{(moved[table[masks]] = amps[masks], 0)...};
+	(void)std::initializer_list <int>{(amps[masks] = moved[masks], 0)...};
+}
+
+template <unsigned int no_qubits>
+template <unsigned int target, std::size_t... pairs>
+constexpr typename small_circuit <no_qubits>::kernel small_circuit <no_qubits>::gateKernelFor(std::index_sequence <pairs...>) {
+	return &gateKernel <target, pairs...>;
+}
+template <unsigned int no_qubits>
+template <unsigned int target, std::size_t... pairs>
+constexpr typename small_circuit <no_qubits>::kernel small_circuit <no_qubits>::swapKernelFor(std::index_sequence <pairs...>) {
+	return &swapKernel <target, pairs...>;
+}
+template <unsigned int no_qubits>
+template <std::size_t... masks>
+constexpr typename small_circuit <no_qubits>::kernel small_circuit <no_qubits>::phaseKernelFor(std::index_sequence <masks...>) {
+	return &phaseKernel <masks...>;
+}
+template <unsigned int no_qubits>
+template <std::size_t... masks>
+constexpr typename small_circuit <no_qubits>::kernel small_circuit <no_qubits>::orderKernelFor(std::index_sequence <masks...>) {
+	return &orderKernel <masks...>;
+}
+template <unsigned int no_qubits>
+template <std::size_t... targets>
+typename small_circuit <no_qubits>::kernel small_circuit <no_qubits>::gateKernelOf(unsigned int target, std::index_sequence <targets...>) {
+	static constexpr kernel table[] = {gateKernelFor <targets>(std::make_index_sequence <no_states / 2>())...};
+	return table[target];
+}
+template <unsigned int no_qubits>
+template <std::size_t... targets>
+typename small_circuit <no_qubits>::kernel small_circuit <no_qubits>::swapKernelOf(unsigned int target, std::index_sequence <targets...>) {
+	static constexpr kernel table[] = {swapKernelFor <targets>(std::make_index_sequence <no_states / 2>())...};
+	return table[target];
+}
+
+template <unsigned int no_qubits>
+small_circuit <no_qubits>::small_circuit(const circuit <no_qubits> &from) {
+	const std::vector <instruction> &gates = from.Instructions();
+	for (std::size_t ind = 0; ind < gates.size(); ind++) {
+		const instruction &gate = gates[ind];
+		std::size_t run_end = ind + 1;
+		if (gate.diagonal()) {
+			while (run_end < gates.size() && gates[run_end].diagonal()) {
+				run_end++;
+			}
+			std::array <std::complex <double>, no_states> table;
+			table.fill(1);
+			applyPhases(table.data(), no_states, 0, gates.data() + ind, gates.data() + run_end);
+			operations.push_back({phaseKernelFor(std::make_index_sequence <no_states>()), 0, (std::uint32_t)phases.size(), {}});
+			phases.push_back(table);
+		}
+		else if (gate.permutation()) {
+			while (run_end < gates.size() && gates[run_end].permutation()) {
+				run_end++;
+			}
+			if (run_end - ind == 1) {
+				operations.push_back({swapKernelOf(gate.target, std::make_index_sequence <no_qubits>()), (std::uint32_t)gate.ctl_mask, 0, {}});
+			}
+			else {
+				std::array <std::uint8_t, no_states> table;
+				for (std::size_t mask = 0; mask < no_states; mask++) {
+					table[mask] = (std::uint8_t)permuteIndex(mask, gates.data() + ind, gates.data() + run_end);
+				}
+				operations.push_back({orderKernelFor(std::make_index_sequence <no_states>()), 0, (std::uint32_t)orders.size(), {}});
+				orders.push_back(table);
+			}
+		}
+		else {
+			operations.push_back({gateKernelOf(gate.target, std::make_index_sequence <no_qubits>()), (std::uint32_t)gate.ctl_mask, 0, gate.matrix()});
+		}
+		ind = run_end - 1;
+	}
+}
+
+template <unsigned int no_qubits>
+void small_circuit <no_qubits>::Apply(small_state <no_qubits> &init) const {
+	for (const operation &now : operations) {
+		now.run(init.state_vector.data(), *this, now);
+	}
+}
+
+template <unsigned int no_qubits>
+std::size_t small_circuit <no_qubits>::Size() const {
+	return operations.size();
+}
+
+#undef SMALL_QUBITS
@@ -0,0 +1,348 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <complex>
+#include <cstddef>
+#include <cstdint>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "instruction.h"
+#include "storage.h"
+#include "schedule.h"
+
+/*
+ * Amplitudes whose squared magnitude falls below this are dropped from a sparse state, so that amplitudes that cancel
+ * out up to rounding errors do not linger in its support
+ */
+#define SPARSE_EPSILON 1e-30
+
+/*
+ * State vector that only stores its non zero amplitudes, as two arrays sorted by basis state. Gates, measurements and
+ * sampling work on those arrays directly, so their cost grows with the number of non zero amplitudes rather than with
+ * 2 ^ no_qubits, which suits basis states, GHZ states and codewords on wide registers. Once the support grows past
+ * 'threshold' the state switches to a dense state vector for good and from then on behaves like the state class.
+ */
+template <unsigned int no_qubits>
+class sparse_state {
+	static_assert(no_qubits < 64, "Sparse states are indexed by 64 bit masks!");
+private:
+	std::vector <std::size_t> indices;
+	std::vector <std::complex <double>> values;
+	amplitudes dense;
+	bool is_dense = false;
+	std::size_t threshold;
+	double norm_factor = 1;
+
+	void sortEntries();
+	void makeDense();
+	void applySparse(const instruction &gate);
+	std::size_t get_random_state();
+	void collapse(std::size_t read_mask, std::size_t rez_mask);
+public:
+	/*
+	 * Starts in the basis state 'basis'. The default threshold is a sixteenth of the dense state vector.
+	 */
+	explicit sparse_state(std::size_t basis = 0);
+	explicit sparse_state(std::size_t basis, std::size_t threshold);
+	unsigned int size() const;
+
+	/*
+	 * Number of non zero amplitudes currently stored, and whether the state has switched to a dense state vector
+	 */
+	std::size_t support() const;
+	bool isDense() const;
+
+	/*
+	 * returns the current state vector as a complex vector of size 2 ^ no_qubits
+	 */
+	std::vector <std::complex <double>> getState() const;
+
+	/*
+	 * returns the non zero amplitudes as (basis state, amplitude) pairs, sorted by basis state
+	 */
+	std::vector <std::pair <std::size_t, std::complex <double>>> getEntries() const;
+
+	/*
+	 * Measures one or more qubits. Returns the reading and modifies the state, just like state::measure
+	 */
+	bool measure(unsigned int id);
+	std::vector <bool> measure(std::vector <unsigned int> ids);
+
+	/*
+	 * Draws 'shots' basis states from the distribution of the state, without modifying it. Throws if the state has no
+	 * non zero amplitude left to draw from.
+	 */
+	std::vector <std::size_t> sample(std::size_t shots) const;
+
+	/*
+	 * Applies instructions gate by gate, switching to the dense state vector as soon as the support gets too large
+	 */
+	void apply(const instruction *first, const instruction *last);
+};
+
+template <unsigned int no_qubits>
+sparse_state <no_qubits>::sparse_state(std::size_t basis) : sparse_state(basis, std::max((std::size_t)1, ((std::size_t)1 << no_qubits) >> 4)) {}
+template <unsigned int no_qubits>
+sparse_state <no_qubits>::sparse_state(std::size_t basis, std::size_t threshold) : indices(1, basis), values(1, 1), dense(0), threshold(threshold) {
+	if (basis >> no_qubits != 0) {
+		throw std::runtime_error("Basis state not in range!\n");
+	}
+}
+template <unsigned int no_qubits>
+unsigned int sparse_state <no_qubits>::size() const {
+	return no_qubits;
+}
+template <unsigned int no_qubits>
+std::size_t sparse_state <no_qubits>::support() const {
+	if (!is_dense) {
+		return indices.size();
+	}
+	std::size_t count = 0;
+	for (std::complex <double> val : dense) {
+		count += std::norm(val) >= SPARSE_EPSILON;
+	}
+	return count;
+}
+template <unsigned int no_qubits>
+bool sparse_state <no_qubits>::isDense() const {
+	return is_dense;
+}
+
+template <unsigned int no_qubits>
+std::vector <std::complex <double>> sparse_state <no_qubits>::getState() const {
+	std::vector <std::complex <double>> ans((std::size_t)1 << no_qubits);
+	double sqrt_norm = std::sqrt(norm_factor);
+	if (is_dense) {
+		for (std::size_t mask = 0; mask < ans.size(); mask++) {
+			ans[mask] = dense[mask] / sqrt_norm;
+		}
+	}
+	else {
+		for (std::size_t ind = 0; ind < indices.size(); ind++) {
+			ans[indices[ind]] = values[ind] / sqrt_norm;
+		}
+	}
+	return ans;
+}
+template <unsigned int no_qubits>
+std::vector <std::pair <std::size_t, std::complex <double>>> sparse_state <no_qubits>::getEntries() const {
+	std::vector <std::pair <std::size_t, std::complex <double>>> ans;
+	double sqrt_norm = std::sqrt(norm_factor);
+	if (is_dense) {
+		for (std::size_t mask = 0; mask < dense.size(); mask++) {
+			if (std::norm(dense[mask]) >= SPARSE_EPSILON) {
+				ans.emplace_back(mask, dense[mask] / sqrt_norm);
+			}
+		}
+	}
+	else {
+		for (std::size_t ind = 0; ind < indices.size(); ind++) {
+			ans.emplace_back(indices[ind], values[ind] / sqrt_norm);
+		}
+	}
+	return ans;
+}
+
+template <unsigned int no_qubits>
+void sparse_state <no_qubits>::sortEntries() {
+	std::vector <std::size_t> order(indices.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::sort(order.begin(), order.end(), [&](std::size_t first, std::size_t second) {
+		return indices[first] < indices[second];
+	});
+	std::vector <std::size_t> sorted_indices(order.size());
+	std::vector <std::complex <double>> sorted_values(order.size());
+	for (std::size_t ind = 0; ind < order.size(); ind++) {
+		sorted_indices[ind] = indices[order[ind]];
+		sorted_values[ind] = values[order[ind]];
+	}
+	indices.swap(sorted_indices);
+	values.swap(sorted_values);
+}
+template <unsigned int no_qubits>
+void sparse_state <no_qubits>::makeDense() {
+	dense = amplitudes((std::size_t)1 << no_qubits);
+	for (std::size_t ind = 0; ind < indices.size(); ind++) {
+		dense[indices[ind]] = values[ind];
+	}
+	indices = std::vector <std::size_t>();
+	values = std::vector <std::complex <double>>();
+	is_dense = true;
+}
+
+template <unsigned int no_qubits>
+void sparse_state <no_qubits>::applySparse(const instruction &gate) {
+	std::size_t ctl_mask = gate.ctl_mask;
+	if (gate.diagonal()) {
+		std::size_t mask = gate.mask();
+		std::complex <double> phase = std::polar(1.0, gate.phase);
+		for (std::size_t ind = 0; ind < indices.size(); ind++) {
+			if ((indices[ind] & mask) == mask) {
+				values[ind] *= phase;
+			}
+		}
+		return;
+	}
+	std::size_t target_mask = (std::size_t)1 << gate.target;
+	if (gate.permutation()) {
+		for (std::size_t &index : indices) {
+			if ((index & ctl_mask) == ctl_mask) {
+				index ^= target_mask;
+			}
+		}
+		sortEntries();
+		return;
+	}
+
+	// Every pair of basis states the gate mixes is handled once, from whichever of the two comes first in the support
+	std::array <std::complex <double>, 4> matrix = gate.matrix();
+	std::vector <std::size_t> new_indices;
+	std::vector <std::complex <double>> new_values;
+	auto push = [&](std::size_t index, std::complex <double> value) {
+		if (std::norm(value) >= SPARSE_EPSILON * norm_factor) {
+			new_indices.push_back(index);
+			new_values.push_back(value);
+		}
+	};
+	for (std::size_t ind = 0; ind < indices.size(); ind++) {
+		std::size_t index = indices[ind];
+		if ((index & ctl_mask) != ctl_mask) {
+			push(index, values[ind]);
+			continue;
+		}
+		std::size_t partner = std::lower_bound(indices.begin(), indices.end(), index ^ target_mask) - indices.begin();
+		bool paired = partner < indices.size() && indices[partner] == (index ^ target_mask);
+		if (paired && partner < ind) {
+			continue;
+		}
+		std::complex <double> val0 = 0, val1 = 0;
+		(index & target_mask ? val1 : val0) = values[ind];
+		if (paired) {
+			(index & target_mask ? val0 : val1) = values[partner];
+		}
+		push(index & ~target_mask, matrix[0] * val0 + matrix[1] * val1);
+		push(index | target_mask, matrix[2] * val0 + matrix[3] * val1);
+	}
+	indices.swap(new_indices);
+	values.swap(new_values);
+	sortEntries();
+}
+
+template <unsigned int no_qubits>
+void sparse_state <no_qubits>::apply(const instruction *first, const instruction *last) {
+	for (; first != last && !is_dense; first++) {
+		if (first->target >= no_qubits || first->ctl_mask >> no_qubits != 0) {
+			throw std::runtime_error("Qubit index not in range!\n");
+		}
+		applySparse(*first);
+		if (indices.size() > threshold) {
+			makeDense();
+		}
+	}
+	if (first != last) {
+		schedule(first, last, no_qubits).run(dense.data(), dense.size());
+	}
+}
+
+template <unsigned int no_qubits>
+std::size_t sparse_state <no_qubits>::get_random_state() {
+	static thread_local std::default_random_engine rand_generator(std::random_device{}());
+	std::uniform_real_distribution <double> distribution(0, norm_factor);
+	double chosen_num = distribution(rand_generator);
+	if (is_dense) {
+		std::size_t chosen_state = 0;
+		while (chosen_state + 1 < dense.size()) {
+			chosen_num -= std::norm(dense[chosen_state]);
+			if (chosen_num < 0) {
+				break;
+			}
+			chosen_state++;
+		}
+		return chosen_state;
+	}
+	std::size_t chosen = 0;
+	while (chosen + 1 < indices.size()) {
+		chosen_num -= std::norm(values[chosen]);
+		if (chosen_num < 0) {
+			break;
+		}
+		chosen++;
+	}
+	return indices[chosen];
+}
+template <unsigned int no_qubits>
+void sparse_state <no_qubits>::collapse(std::size_t read_mask, std::size_t rez_mask) {
+	norm_factor = 0;
+	if (is_dense) {
+		for (std::size_t mask = 0; mask < dense.size(); mask++) {
+			if ((mask & read_mask) == rez_mask) {
+				norm_factor += std::norm(dense[mask]);
+			}
+			else {
+				dense[mask] = 0;
+			}
+		}
+		return;
+	}
+	std::size_t kept = 0;
+	for (std::size_t ind = 0; ind < indices.size(); ind++) {
+		if ((indices[ind] & read_mask) == rez_mask) {
+			norm_factor += std::norm(values[ind]);
+			indices[kept] = indices[ind];
+			values[kept] = values[ind];
+			kept++;
+		}
+	}
+	indices.resize(kept);
+	values.resize(kept);
+}
+template <unsigned int no_qubits>
+bool sparse_state <no_qubits>::measure(unsigned int id) {
+	std::size_t chosen_state = get_random_state();
+	std::size_t read_mask = (std::size_t)1 << id;
+	collapse(read_mask, chosen_state & read_mask);
+	return chosen_state & read_mask;
+}
+template <unsigned int no_qubits>
+std::vector <bool> sparse_state <no_qubits>::measure(std::vector <unsigned int> ids) {
+	std::size_t chosen_state = get_random_state();
+	std::size_t read_mask = 0;
+	for (unsigned int value : ids) {
+		read_mask |= (std::size_t)1 << value;
+	}
+	collapse(read_mask, chosen_state & read_mask);
+	std::vector <bool> ans(ids.size());
+	for (std::size_t ind = 0; ind < ids.size(); ind++) {
+		ans[ind] = chosen_state & ((std::size_t)1 << ids[ind]);
+	}
+	return ans;
+}
+
+template <unsigned int no_qubits>
+std::vector <std::size_t> sparse_state <no_qubits>::sample(std::size_t shots) const {
+	static thread_local std::default_random_engine rand_generator(std::random_device{}());
+	std::size_t count = is_dense ? dense.size() : indices.size();
+	std::vector <double> cumulative(count);
+	double sum = 0;
+	for (std::size_t ind = 0; ind < count; ind++) {
+		sum += std::norm(is_dense ? dense[ind] : values[ind]);
+		cumulative[ind] = sum;
+	}
+	if (count == 0 || sum <= 0) {
+		throw std::runtime_error("Cannot sample a state with no amplitudes!\n");
+	}
+	std::uniform_real_distribution <double> distribution(0, sum);
+	std::vector <std::size_t> ans(shots);
+	for (std::size_t &now : ans) {
+		std::size_t chosen = std::upper_bound(cumulative.begin(), cumulative.end() - 1, distribution(rand_generator)) - cumulative.begin();
+		now = is_dense ? chosen : indices[chosen];
+	}
+	return ans;
+}
+
+#undef SPARSE_EPSILON
@@ -2,8 +2,17 @@
 
 #include <random>
 #include <complex>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <thread>
+#include <algorithm>
 
 #include "transform.h"
+#include "storage.h"
+#include "kernel.h"
+#include "schedule.h"
 
 class transform;
 
@@ -20,12 +29,34 @@ state <no_qubits> operator*(const transform &modify, const state <no_qubits>&ini
 template <unsigned int no_qubits>
 class state {
 private:
-	std::vector <std::complex <double>> state_vector;
+	amplitudes state_vector;
 	double norm_factor;
 
-	int get_random_state();
+	std::size_t get_random_state();
+
+	/*
+	 * Splits [0, count) into contiguous ranges and calls work(range, first, last) on each of them, in parallel for large
+	 * registers. Returns the number of ranges.
+	 */
+	static unsigned int rangeCount(std::size_t count);
+	template <class function>
+	static unsigned int forRanges(std::size_t count, const function &work);
+	std::size_t readMask(const std::vector <unsigned int> &qubits) const;
+
+	/*
+	 * Layout of a checkpoint file: the header followed by the raw state vector, in native byte order
+	 */
+	struct file_header {
+		char magic[4];
+		std::uint32_t version;
+		std::uint32_t qubits;
+		std::uint32_t reserved;
+		double norm_factor;
+	};
+	static constexpr std::uint32_t file_version = 1;
 public:
 	explicit state();
+	explicit state(const std::string &path); // state vector kept in a memory mapped file at 'path'
 	unsigned int size() const;
 
 	/*
@@ -39,15 +70,46 @@ public:
 	bool measure(unsigned int id);
 	std::vector <bool> measure(std::vector <unsigned int> ids);
 
+	/*
+	 * Marginal distribution of a subset of qubits, without collapsing the state. Entry 'ind' of the result is the
+	 * probability of reading bit j of 'ind' on 'qubits[j]', for every j.
+	 */
+	std::vector <double> probabilities(const std::vector <unsigned int> &qubits) const;
+
+	/*
+	 * Density matrix of a subset of qubits with every other qubit traced out, without collapsing the state. The
+	 * 2 ^ k by 2 ^ k matrix is returned in row-major order, its indices read like those of 'probabilities'.
+	 */
+	std::vector <std::complex <double>> reduced_density_matrix(const std::vector <unsigned int> &qubits) const;
+
 	/*
 	 * Here the '*' operator multiplies a state vector by a transformation matrix
 	 */
 	void operator*=(const transform &modify);
 	friend state <no_qubits> operator* <>(const transform &modify, const state <no_qubits>&ini);
+
+	/*
+	 * Applies compiled instructions gate by gate, in cache blocked passes. Used instead of the circuit matrix for
+	 * registers too large to have one.
+	 */
+	void apply(const schedule &plan);
+	void apply(const instruction *first, const instruction *last);
+
+	/*
+	 * Saves the state to a checkpoint file and restores it from one. Restoring keeps the current storage, so a file
+	 * backed state stays in its file.
+	 */
+	void checkpoint(const std::string &path) const;
+	void restore(const std::string &path);
 };
 
 template <unsigned int no_qubits>
-state <no_qubits>::state() : state_vector(1 << no_qubits, 0) {
+state <no_qubits>::state() : state_vector((std::size_t)1 << no_qubits) {
+	norm_factor = 1;
+	state_vector[0] = 1;
+}
+template <unsigned int no_qubits>
+state <no_qubits>::state(const std::string &path) : state_vector((std::size_t)1 << no_qubits, path) {
 	norm_factor = 1;
 	state_vector[0] = 1;
 }
@@ -67,13 +129,13 @@ std::vector <std::complex <double>> state <no_qubits>::getState() const {
 }
 
 template <unsigned int no_qubits>
-int state <no_qubits>::get_random_state () {
+std::size_t state <no_qubits>::get_random_state () {
 	std::random_device rand_device;
 	std::default_random_engine rand_generator(rand_device());
 	std::uniform_real_distribution<double> distribution(0, norm_factor);
 	double chosen_num = distribution(rand_generator);
-	int chosen_state = 0;
-	while(chosen_state < (1 << no_qubits)) {
+	std::size_t chosen_state = 0;
+	while(chosen_state < state_vector.size()) {
 		chosen_num -= std::abs(state_vector[chosen_state] * state_vector[chosen_state]);
 		if(chosen_num < 0) {
 			break;
@@ -84,11 +146,11 @@ int state <no_qubits>::get_random_state () {
 }
 template <unsigned int no_qubits>
 bool state <no_qubits>::measure (unsigned int id) {
-	int chosen_state = get_random_state();
-	int read_mask = 1 << id;
-	int rez_mask = chosen_state & read_mask;
+	std::size_t chosen_state = get_random_state();
+	std::size_t read_mask = (std::size_t)1 << id;
+	std::size_t rez_mask = chosen_state & read_mask;
 	norm_factor = 0;
-	for (int mask = 0; mask < (1 << no_qubits); mask++) {
+	for (std::size_t mask = 0; mask < state_vector.size(); mask++) {
 		if((mask & read_mask) == rez_mask) {
 			norm_factor += std::abs(state_vector[mask] * state_vector[mask]);
 		}
@@ -96,18 +158,18 @@ bool state <no_qubits>::measure (unsigned int id) {
 			state_vector[mask] = 0;
 		}
 	}
-	return chosen_state & (1 << id);
+	return chosen_state & read_mask;
 }
 template <unsigned int no_qubits>
 std::vector <bool> state <no_qubits>::measure(std::vector <unsigned int> ids) {
-	int chosen_state = get_random_state();
-	int read_mask = 0;
+	std::size_t chosen_state = get_random_state();
+	std::size_t read_mask = 0;
 	for(unsigned int value : ids) {
-		read_mask |= 1 << value;
+		read_mask |= (std::size_t)1 << value;
 	}
-	int rez_mask =  chosen_state & read_mask;
+	std::size_t rez_mask =  chosen_state & read_mask;
 	norm_factor = 0;
-	for (int mask = 0; mask < (1 << no_qubits); mask++) {
+	for (std::size_t mask = 0; mask < state_vector.size(); mask++) {
 		if((mask & read_mask) == rez_mask) {
 			norm_factor += std::abs(state_vector[mask] * state_vector[mask]);
 		}
@@ -117,7 +179,121 @@ std::vector <bool> state <no_qubits>::measure(std::vector <unsigned int> ids) {
 	}
 	std::vector <bool> ans(ids.size());
 	for(int ind = 0; ind < ids.size(); ind++) {
-		ans[ind] = chosen_state & (1 << ids[ind]);
+		ans[ind] = chosen_state & ((std::size_t)1 << ids[ind]);
+	}
+	return ans;
+}
+
+template <unsigned int no_qubits>
+unsigned int state <no_qubits>::rangeCount(std::size_t count) {
+	// Registers too small to be worth the threads are reduced on the calling thread
+	unsigned int no_threads = no_qubits < 16 ? 1 : std::max(1u, std::thread::hardware_concurrency());
+	return (unsigned int)std::max <std::size_t>(1, std::min <std::size_t>(no_threads, count));
+}
+template <unsigned int no_qubits>
+template <class function>
+unsigned int state <no_qubits>::forRanges(std::size_t count, const function &work) {
+	unsigned int no_threads = rangeCount(count);
+	std::vector <std::thread> threads;
+	for (unsigned int ind = 1; ind < no_threads; ind++) {
+		threads.emplace_back(work, ind, count * ind / no_threads, count * (ind + 1) / no_threads);
+	}
+	work(0, 0, count / no_threads);
+	for (std::thread &now : threads) {
+		now.join();
+	}
+	return no_threads;
+}
+template <unsigned int no_qubits>
+std::size_t state <no_qubits>::readMask(const std::vector <unsigned int> &qubits) const {
+	std::size_t read_mask = 0;
+	for (unsigned int pos : qubits) {
+		if (pos >= no_qubits) {
+			throw std::runtime_error("Qubit index not in range!\n");
+		}
+		if (read_mask >> pos & 1) {
+			throw std::runtime_error("A qubit cannot be read twice!\n");
+		}
+		read_mask |= (std::size_t)1 << pos;
+	}
+	return read_mask;
+}
+
+template <unsigned int no_qubits>
+std::vector <double> state <no_qubits>::probabilities(const std::vector <unsigned int> &qubits) const {
+	readMask(qubits);
+	std::size_t no_values = (std::size_t)1 << qubits.size();
+	std::vector <std::vector <double>> partial(rangeCount(state_vector.size()), std::vector <double>(no_values, 0));
+	unsigned int used = forRanges(state_vector.size(), [&](unsigned int range, std::size_t first, std::size_t last) {
+		std::vector <double> &sums = partial[range];
+		for (std::size_t mask = first; mask < last; mask++) {
+			std::size_t value = 0;
+			for (std::size_t ind = 0; ind < qubits.size(); ind++) {
+				value |= (mask >> qubits[ind] & 1) << ind;
+			}
+			sums[value] += std::norm(state_vector[mask]);
+		}
+	});
+	std::vector <double> ans(no_values, 0);
+	for (unsigned int range = 0; range < used; range++) {
+		for (std::size_t value = 0; value < no_values; value++) {
+			ans[value] += partial[range][value];
+		}
+	}
+	for (double &val : ans) {
+		val /= norm_factor;
+	}
+	return ans;
+}
+template <unsigned int no_qubits>
+std::vector <std::complex <double>> state <no_qubits>::reduced_density_matrix(const std::vector <unsigned int> &qubits) const {
+	std::size_t read_mask = readMask(qubits);
+	std::size_t no_values = (std::size_t)1 << qubits.size();
+	std::vector <std::size_t> spread(no_values, 0);
+	for (std::size_t value = 0; value < no_values; value++) {
+		for (std::size_t ind = 0; ind < qubits.size(); ind++) {
+			spread[value] |= (value >> ind & 1) << qubits[ind];
+		}
+	}
+	std::vector <unsigned int> others;
+	for (unsigned int pos = 0; pos < no_qubits; pos++) {
+		if (!(read_mask >> pos & 1)) {
+			others.push_back(pos);
+		}
+	}
+
+	// Every assignment of the other qubits adds the outer product of the amplitudes it leaves for the read ones
+	std::size_t no_rests = state_vector.size() >> qubits.size();
+	std::vector <std::vector <std::complex <double>>> partial(rangeCount(no_rests), std::vector <std::complex <double>>(no_values * no_values, 0));
+	unsigned int used = forRanges(no_rests, [&](unsigned int range, std::size_t first, std::size_t last) {
+		std::vector <std::complex <double>> &sums = partial[range];
+		std::vector <std::complex <double>> local(no_values);
+		for (std::size_t rest = first; rest < last; rest++) {
+			std::size_t base = 0;
+			for (std::size_t ind = 0; ind < others.size(); ind++) {
+				base |= (rest >> ind & 1) << others[ind];
+			}
+			for (std::size_t value = 0; value < no_values; value++) {
+				local[value] = state_vector[base | spread[value]];
+			}
+			for (std::size_t row = 0; row < no_values; row++) {
+				if (local[row] == std::complex <double>(0)) {
+					continue;
+				}
+				for (std::size_t col = 0; col < no_values; col++) {
+					sums[row * no_values + col] += local[row] * std::conj(local[col]);
+				}
+			}
+		}
+	});
+	std::vector <std::complex <double>> ans(no_values * no_values, 0);
+	for (unsigned int range = 0; range < used; range++) {
+		for (std::size_t ind = 0; ind < ans.size(); ind++) {
+			ans[ind] += partial[range][ind];
+		}
+	}
+	for (std::complex <double> &val : ans) {
+		val /= norm_factor;
 	}
 	return ans;
 }
@@ -140,4 +316,43 @@ state <no_qubits> operator*(const transform &modify, const state <no_qubits> &in
 	}
 	fin.norm_factor = ini.norm_factor * modify.norm_factor;
 	return fin;
-}
\ No newline at end of file
+}
+
+template <unsigned int no_qubits>
+void state <no_qubits>::apply(const schedule &plan) {
+	plan.run(state_vector.data(), state_vector.size());
+}
+template <unsigned int no_qubits>
+void state <no_qubits>::apply(const instruction *first, const instruction *last) {
+	apply(schedule(first, last, no_qubits));
+}
+
+template <unsigned int no_qubits>
+void state <no_qubits>::checkpoint(const std::string &path) const {
+	std::size_t data_at = sizeof(file_header);
+	mapping out(path, data_at + state_vector.size() * sizeof(std::complex <double>));
+	char *base = static_cast <char *>(out.data());
+	file_header header = {{'Q', 'S', 'T', 'A'}, file_version, no_qubits, 0, norm_factor};
+	std::memcpy(base, &header, sizeof(header));
+	std::memcpy(base + data_at, state_vector.data(), state_vector.size() * sizeof(std::complex <double>));
+	out.flush();
+}
+template <unsigned int no_qubits>
+void state <no_qubits>::restore(const std::string &path) {
+	mapping in(path);
+	const char *base = static_cast <const char *>(in.data());
+	file_header header;
+	std::size_t data_at = sizeof(file_header);
+	if (in.size() < sizeof(header)) {
+		throw std::runtime_error("File is not a state checkpoint!\n");
+	}
+	std::memcpy(&header, base, sizeof(header));
+	if (std::memcmp(header.magic, "QSTA", 4) != 0 || header.version != file_version) {
+		throw std::runtime_error("File is not a state checkpoint of a supported version!\n");
+	}
+	if (header.qubits != no_qubits || in.size() < data_at + state_vector.size() * sizeof(std::complex <double>)) {
+		throw std::runtime_error("State checkpoint has a different number of qubits!\n");
+	}
+	std::memcpy(state_vector.data(), base + data_at, state_vector.size() * sizeof(std::complex <double>));
+	norm_factor = header.norm_factor;
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <complex>
+#include <cstddef>
+#include <string>
+#include <algorithm>
+#include <vector>
+
+#include "mapping.h"
+
+/*
+ * Storage backend of a state vector. Amplitudes either live on the heap or in a memory mapped file, which lets a state
+ * grow past the available RAM as long as it fits on a local disk. Copies are always made on the heap, while assigning to
+ * a storage of the same size overwrites the amplitudes in place and so keeps a file backed storage in its file.
+ */
+class amplitudes {
+private:
+	std::vector <std::complex <double>> memory;
+	mapping file;
+	std::complex <double> *values = nullptr;
+	std::size_t count = 0;
+public:
+	explicit amplitudes(std::size_t count); // on the heap, all zero
+	explicit amplitudes(std::size_t count, const std::string &path); // mapped from 'path', all zero
+	amplitudes(const amplitudes &other);
+	amplitudes(amplitudes &&other) noexcept;
+	amplitudes &operator=(const amplitudes &other);
+	amplitudes &operator=(amplitudes &&other) noexcept;
+
+	std::size_t size() const;
+	bool mapped() const;
+	std::complex <double> *data();
+	const std::complex <double> *data() const;
+
+	std::complex <double> &operator[](std::size_t ind);
+	const std::complex <double> &operator[](std::size_t ind) const;
+	std::complex <double> *begin();
+	std::complex <double> *end();
+	const std::complex <double> *begin() const;
+	const std::complex <double> *end() const;
+
+	/*
+	 * Writes a file backed storage back to its file. Does nothing for heap storage.
+	 */
+	void flush();
+};
+
+amplitudes::amplitudes(std::size_t count) : memory(count, 0), count(count) {
+	values = memory.data();
+}
+amplitudes::amplitudes(std::size_t count, const std::string &path) : file(path, count * sizeof(std::complex <double>)), count(count) {
+	values = static_cast <std::complex <double> *>(file.data());
+}
+amplitudes::amplitudes(const amplitudes &other) : memory(other.begin(), other.end()), count(other.count) {
+	values = memory.data();
+}
+amplitudes::amplitudes(amplitudes &&other) noexcept : memory(std::move(other.memory)), file(std::move(other.file)), values(other.values), count(other.count) {
+	other.values = nullptr;
+	other.count = 0;
+}
+amplitudes &amplitudes::operator=(const amplitudes &other) {
+	if (this != &other) {
+		if (count == other.count) {
+			std::copy(other.begin(), other.end(), values);
+		}
+		else {
+			*this = amplitudes(other);
+		}
+	}
+	return *this;
+}
+amplitudes &amplitudes::operator=(amplitudes &&other) noexcept {
+	if (this != &other) {
+		if (mapped() && count == other.count) {
+			std::copy(other.begin(), other.end(), values);
+		}
+		else {
+			memory = std::move(other.memory);
+			file = std::move(other.file);
+			values = other.values;
+			count = other.count;
+			other.values = nullptr;
+			other.count = 0;
+		}
+	}
+	return *this;
+}
+
+std::size_t amplitudes::size() const {
+	return count;
+}
+bool amplitudes::mapped() const {
+	return file.data() != nullptr;
+}
+std::complex <double> *amplitudes::data() {
+	return values;
+}
+const std::complex <double> *amplitudes::data() const {
+	return values;
+}
+
+std::complex <double> &amplitudes::operator[](std::size_t ind) {
+	return values[ind];
+}
+const std::complex <double> &amplitudes::operator[](std::size_t ind) const {
+	return values[ind];
+}
+std::complex <double> *amplitudes::begin() {
+	return values;
+}
+std::complex <double> *amplitudes::end() {
+	return values + count;
+}
+const std::complex <double> *amplitudes::begin() const {
+	return values;
+}
+const std::complex <double> *amplitudes::end() const {
+	return values + count;
+}
+
+void amplitudes::flush() {
+	if (mapped()) {
+		file.flush();
+	}
+}
@@ -46,6 +46,12 @@ public:
 	template <unsigned int size>
 	friend state <size>operator*(const transform &modify, const state <size>&ini);
 
+	/*
+	 * Circuits copy the matrix in and out of their compiled program files
+	 */
+	template <unsigned int size>
+	friend class circuit;
+
 	/*
 	 * Here the '*' operator multiplies 2 transformation matrices to form a single one representing both
 	 */